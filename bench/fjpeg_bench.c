@@ -0,0 +1,344 @@
+/*
+ * fjpeg_bench.c — femtojpeg benchmark and corpus runner
+ *
+ * Decodes every .jpg in the given directories (or the given files) at each
+ * requested scale and reports throughput plus a per-stage time breakdown.
+ * With -r, compares the output against reference PPMs from another decoder
+ * (e.g. djpeg) and reports PSNR.
+ *
+ *   fjpeg_bench [-s 1,2,4,8] [-n iters] [-r refdir] [-f flags] dir|file...
+ *
+ * Throughput is the best of iters runs. Stage shares come from one extra
+ * profiled run, so the hook overhead does not inflate the throughput.
+ *
+ * Builds femtojpeg.c into this translation unit to hook FJPEG_STAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+
+static void bench_stage(int s);
+#define FJPEG_STAGE(s) bench_stage(s)
+#include "../femtojpeg.c"
+
+/*--- Timing ---*/
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int prof_on;
+static int prof_cur;
+static double prof_t0;
+static double prof_sum[STAGE_COUNT];
+
+static void bench_stage(int s)
+{
+    if (!prof_on) return;
+    double t = now_sec();
+    prof_sum[prof_cur] += t - prof_t0;
+    prof_t0 = t;
+    prof_cur = s;
+}
+
+static void prof_start(void)
+{
+    memset(prof_sum, 0, sizeof(prof_sum));
+    prof_cur = STAGE_PARSE;
+    prof_t0 = now_sec();
+    prof_on = 1;
+}
+
+static void prof_stop(void)
+{
+    bench_stage(STAGE_PARSE);
+    prof_on = 0;
+}
+
+static const char *stage_name[STAGE_COUNT] = {
+    "parse", "huff", "idct", "color", "cb"
+};
+
+/*--- Output capture ---*/
+
+typedef struct {
+    uint16_t *img;
+    int w, h;
+    int rows;
+} capture_t;
+
+static void capture_row(int y, int w, const uint16_t *rgb565, void *user)
+{
+    capture_t *cap = user;
+    if (y < cap->h && w == cap->w)
+        memcpy(cap->img + (size_t)y * w, rgb565, w * sizeof(uint16_t));
+    cap->rows++;
+}
+
+/*--- Reference comparison ---*/
+
+static uint8_t *load_ppm(const char *path, int *w, int *h)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    int maxv;
+    if (fscanf(f, "P6 %d %d %d", w, h, &maxv) != 3 || maxv != 255) {
+        fclose(f);
+        return NULL;
+    }
+    fgetc(f);
+    size_t n = (size_t)*w * *h * 3;
+    uint8_t *px = malloc(n);
+    if (px && fread(px, 1, n, f) != n) { free(px); px = NULL; }
+    fclose(f);
+    return px;
+}
+
+/* PSNR of the RGB565 output against a full-size reference, box-filtered
+ * down by scale and rounded to RGB565 so only decoder error counts */
+static double psnr_vs_ref(const capture_t *cap, const uint8_t *ref, int rw, int rh, int scale)
+{
+    double se = 0;
+    size_t n = 0;
+    for (int y = 0; y < cap->h && (y + 1) * scale <= rh; y++) {
+        for (int x = 0; x < cap->w && (x + 1) * scale <= rw; x++) {
+            uint16_t v = cap->img[(size_t)y * cap->w + x];
+            int out[3] = { (v >> 11) << 3, ((v >> 5) & 63) << 2, (v & 31) << 3 };
+            for (int k = 0; k < 3; k++) {
+                int sum = 0;
+                for (int yy = 0; yy < scale; yy++)
+                    for (int xx = 0; xx < scale; xx++)
+                        sum += ref[((size_t)(y * scale + yy) * rw + x * scale + xx) * 3 + k];
+                int r = (sum + scale * scale / 2) / (scale * scale);
+                r &= k == 1 ? ~3 : ~7;
+                double d = out[k] - r;
+                se += d * d;
+                n++;
+            }
+        }
+    }
+    if (n == 0) return 0;
+    if (se == 0) return 99.0;
+    return 10 * log10(255.0 * 255.0 * n / se);
+}
+
+/*--- Corpus ---*/
+
+typedef struct {
+    double bytes, pixels, sec;
+    double stage[STAGE_COUNT];
+    int files, fails;
+} total_t;
+
+static int opt_iters = 5;
+static unsigned opt_flags;
+static const char *opt_refdir;
+
+static uint8_t *read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *d = n > 0 ? malloc(n) : NULL;
+    if (d && fread(d, 1, n, f) != (size_t)n) { free(d); d = NULL; }
+    fclose(f);
+    *len = (size_t)n;
+    return d;
+}
+
+static void bench_file(const char *path, int scale, total_t *tot)
+{
+    size_t len;
+    uint8_t *data = read_file(path, &len);
+    fjpeg_info_t info;
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+    if (!data || fjpeg_info(data, len, &info) != 0) {
+        printf("%-28s %d  unreadable\n", name, scale);
+        tot->fails++;
+        free(data);
+        return;
+    }
+
+    capture_t cap = { NULL, info.width / scale, info.height / scale, 0 };
+    cap.img = calloc((size_t)cap.w * cap.h + 1, sizeof(uint16_t));
+
+    fjpeg_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.scale = scale;
+    opts.flags = opt_flags;
+
+    /* Best of iters */
+    double best = 1e30;
+    int ret = 0;
+    for (int i = 0; i < opt_iters && ret == 0; i++) {
+        cap.rows = 0;
+        double t0 = now_sec();
+        ret = fjpeg_decode_ex(data, len, &opts, capture_row, &cap);
+        double t = now_sec() - t0;
+        if (t < best) best = t;
+    }
+    if (ret != 0 || cap.rows != cap.h) {
+        printf("%-28s %d  decode failed\n", name, scale);
+        tot->fails++;
+        free(cap.img);
+        free(data);
+        return;
+    }
+
+    /* Stage breakdown from one profiled run */
+    prof_start();
+    fjpeg_decode_ex(data, len, &opts, capture_row, &cap);
+    prof_stop();
+    double prof_total = 0;
+    for (int s = 0; s < STAGE_COUNT; s++) prof_total += prof_sum[s];
+
+    double mp = (double)info.width * info.height / 1e6;
+    printf("%-28s %d %5ux%-5u %7.1f %8.3f %7.1f %7.1f",
+           name, scale, info.width, info.height, len / 1024.0,
+           best * 1e3, len / best / 1e6, mp / best);
+    for (int s = 0; s < STAGE_COUNT; s++)
+        printf(" %5.1f", prof_total > 0 ? 100 * prof_sum[s] / prof_total : 0);
+
+    if (opt_refdir) {
+        char ref_path[1024];
+        int n = (int)(strrchr(name, '.') ? strrchr(name, '.') - name : (long)strlen(name));
+        snprintf(ref_path, sizeof(ref_path), "%s/%.*s.ppm", opt_refdir, n, name);
+        int rw, rh;
+        uint8_t *ref = load_ppm(ref_path, &rw, &rh);
+        if (ref) printf(" %6.2f", psnr_vs_ref(&cap, ref, rw, rh, scale));
+        else printf("      -");
+        free(ref);
+    }
+    printf("\n");
+
+    tot->bytes += len;
+    tot->pixels += mp;
+    tot->sec += best;
+    for (int s = 0; s < STAGE_COUNT; s++)
+        tot->stage[s] += prof_total > 0 ? best * prof_sum[s] / prof_total : 0;
+    tot->files++;
+
+    free(cap.img);
+    free(data);
+}
+
+static int is_jpeg(const char *name)
+{
+    size_t n = strlen(name);
+    return (n > 4 && (!strcmp(name + n - 4, ".jpg") || !strcmp(name + n - 4, ".JPG"))) ||
+           (n > 5 && (!strcmp(name + n - 5, ".jpeg") || !strcmp(name + n - 5, ".JPEG")));
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Expand a directory to its .jpg files, sorted; anything else is a file */
+static int collect(const char *arg, char ***list, int *count)
+{
+    DIR *d = opendir(arg);
+    if (!d) {
+        *list = realloc(*list, (*count + 1) * sizeof(char *));
+        (*list)[(*count)++] = strdup(arg);
+        return 0;
+    }
+    int first = *count;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (!is_jpeg(e->d_name)) continue;
+        size_t n = strlen(arg) + strlen(e->d_name) + 2;
+        char *p = malloc(n);
+        snprintf(p, n, "%s/%s", arg, e->d_name);
+        *list = realloc(*list, (*count + 1) * sizeof(char *));
+        (*list)[(*count)++] = p;
+    }
+    closedir(d);
+    qsort(*list + first, *count - first, sizeof(char *), cmp_str);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: fjpeg_bench [-s 1,2,4,8] [-n iters] [-r refdir] [-f flags] dir|file...\n"
+        "  -s  scales to run (default 1,2,4,8)\n"
+        "  -n  timed runs per file and scale, best is reported (default 5)\n"
+        "  -r  directory of reference <name>.ppm files for PSNR\n"
+        "  -f  fjpeg_opts_t.flags, e.g. 1 for FJPEG_SINGLE_PASS\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int scales[4] = { 1, 2, 4, 8 }, nscales = 4;
+    char **files = NULL;
+    int nfiles = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && i + 1 < argc) {
+            const char *v = argv[++i];
+            switch (argv[i - 1][1]) {
+            case 's':
+                nscales = 0;
+                for (const char *p = v; *p && nscales < 4; p++) {
+                    int sc = atoi(p);
+                    if (sc != 1 && sc != 2 && sc != 4 && sc != 8) usage();
+                    scales[nscales++] = sc;
+                    while (p[1] && p[1] != ',') p++;
+                    if (p[1] == ',') p++;
+                }
+                break;
+            case 'n': opt_iters = atoi(v); if (opt_iters < 1) usage(); break;
+            case 'r': opt_refdir = v; break;
+            case 'f': opt_flags = (unsigned)strtoul(v, NULL, 0); break;
+            default: usage();
+            }
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            collect(argv[i], &files, &nfiles);
+        }
+    }
+    if (nfiles == 0) usage();
+
+    int fails = 0;
+    for (int si = 0; si < nscales; si++) {
+        total_t tot;
+        memset(&tot, 0, sizeof(tot));
+
+        printf("%-28s %s %11s %7s %8s %7s %7s", "file", "s", "size", "KB", "ms", "MB/s", "MP/s");
+        for (int s = 0; s < STAGE_COUNT; s++) printf(" %4s%%", stage_name[s]);
+        printf(opt_refdir ? "   PSNR\n" : "\n");
+
+        for (int f = 0; f < nfiles; f++)
+            bench_file(files[f], scales[si], &tot);
+
+        if (tot.files) {
+            printf("%-28s %d %11s %7.1f %8.3f %7.1f %7.1f",
+                   "total", scales[si], "", tot.bytes / 1024, tot.sec * 1e3,
+                   tot.bytes / tot.sec / 1e6, tot.pixels / tot.sec);
+            for (int s = 0; s < STAGE_COUNT; s++)
+                printf(" %5.1f", 100 * tot.stage[s] / tot.sec);
+            printf("\n");
+        }
+        printf("\n");
+        fails += tot.fails;
+    }
+
+    for (int f = 0; f < nfiles; f++) free(files[f]);
+    free(files);
+    return fails ? 1 : 0;
+}
@@ -1,45 +1,244 @@
 /*
  * femtojpeg.c — Ultra-minimal baseline JPEG decoder
  *
- * Decodes baseline sequential JPEG (SOF0) images to RGB565.
- * Winograd IDCT with 8-bit fixed-point integer math.
- * In-memory input, row-by-row output via callback.
- * Supports 1/4 and 1/8 downscaling for large images.
+ * Decodes baseline sequential (SOF0) and progressive (SOF2) JPEG images
+ * to RGB565. Winograd IDCT with 8-bit fixed-point integer math.
+ * In-memory, memory-mapped or pulled (read callback) input, row-by-row
+ * output via callback.
+ * Supports 1/2, 1/4 and 1/8 downscaling for large images.
  *
  * Inspired by picojpeg (public domain, Rich Geldreich).
  * Written from scratch for the Survival Workstation project.
  */
 
+/* mmap and posix_madvise for the mapped-input helpers */
+#if !defined(_POSIX_C_SOURCE) && !defined(ESP_PLATFORM) && !defined(_WIN32)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "femtojpeg.h"
 #include <string.h>
 #include <stdlib.h>
 
+/*--- Configuration ---*/
+
+/* Huffman lookahead width in bits. Codes up to this length decode with a
+ * single table lookup; longer codes fall back to the canonical walk.
+ * Costs 2^N * 2 bytes per table (4 tables) plus the same again for the
+ * two fused AC tables. Set to 0 for the tiny-RAM build (~100-byte tables). */
+#ifndef FJPEG_HUFF_LOOKAHEAD
+#define FJPEG_HUFF_LOOKAHEAD 9
+#endif
+
+#if FJPEG_HUFF_LOOKAHEAD > 12
+#error "FJPEG_HUFF_LOOKAHEAD must be 0..12"
+#endif
+
+/* Bit buffer width. 64 bits lets fill_bits load 8 bytes at a time; 32-bit
+ * targets default to a 32-bit buffer (4-byte refills, cheaper shifts). */
+#ifndef FJPEG_BITBUF_BITS
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define FJPEG_BITBUF_BITS 64
+#else
+#define FJPEG_BITBUF_BITS 32
+#endif
+#endif
+
+/* Vector IDCT kernels (SSE2 on x86, NEON on ARM). 0 forces the scalar
+ * reference code, which is also the fallback on every other target. */
+#ifndef FJPEG_SIMD
+#define FJPEG_SIMD 1
+#endif
+
+#if FJPEG_SIMD && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define FJPEG_SSE2 1
+#include <emmintrin.h>
+#elif FJPEG_SIMD && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define FJPEG_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Vector RGB565 row converters (little-endian lanes only) */
+#if FJPEG_SSE2 || (FJPEG_NEON && !defined(__ARM_BIG_ENDIAN))
+#define FJPEG_VEC_RGB565 1
+#endif
+
+/* MCU loops specialized per sampling layout and scale, so the block
+ * counts and block side are constants (about 11 KB of code). 0 keeps
+ * just the generic loop, the default when optimizing for size. */
+#ifndef FJPEG_SPECIALIZE
+#ifdef __OPTIMIZE_SIZE__
+#define FJPEG_SPECIALIZE 0
+#else
+#define FJPEG_SPECIALIZE 1
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define FJPEG_FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define FJPEG_FORCE_INLINE inline
+#endif
+
+/* Mapped input: fjpeg_map_file through mmap on POSIX hosts,
+ * fjpeg_map_partition through esp_partition_mmap on ESP-IDF (5.0 or
+ * later). Set to 0, or on other targets, they only fail. */
+#ifndef FJPEG_MMAP
+#if defined(ESP_PLATFORM) || defined(__unix__) || defined(__APPLE__)
+#define FJPEG_MMAP 1
+#else
+#define FJPEG_MMAP 0
+#endif
+#endif
+
+#if FJPEG_MMAP && defined(ESP_PLATFORM)
+#include "esp_partition.h"
+#elif FJPEG_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Default read window for pull input (fjpeg_opts_t.read) when
+ * fjpeg_opts_t.window is 0 */
+#ifndef FJPEG_STREAM_WINDOW
+#define FJPEG_STREAM_WINDOW 4096
+#endif
+
+/* FJPEG_PIPELINE ring depth in MCUs (about 800 bytes each at 4:2:0).
+ * The ring needs the GCC/Clang atomics; other compilers decode
+ * serially. */
+#ifndef FJPEG_PIPE_MCUS
+#define FJPEG_PIPE_MCUS 16
+#endif
+
+#if defined(__GNUC__)
+#define FJPEG_PIPE 1
+#else
+#define FJPEG_PIPE 0
+#endif
+
+/* Spin-wait hint for the ring: lets the other hyperthread run and
+ * saves power while one side polls the other */
+#if FJPEG_PIPE && (defined(__i386__) || defined(__x86_64__))
+#define PIPE_RELAX() __builtin_ia32_pause()
+#elif FJPEG_PIPE && (defined(__aarch64__) || (defined(__ARM_ARCH) && __ARM_ARCH >= 7))
+#define PIPE_RELAX() __asm__ __volatile__("yield")
+#else
+#define PIPE_RELAX() ((void)0)
+#endif
+
+/* Profiling hook. FJPEG_STAGE(s) is called each time the decoder moves
+ * to a different kind of work; bench/ defines it to charge the time
+ * since the previous call to the previous stage. No-op by default. */
+#ifndef FJPEG_STAGE
+#define FJPEG_STAGE(s) ((void)0)
+#endif
+
+/* Decode statistics for fjpeg_opts_t.stats: block, marker and Huffman
+ * counters in the hot paths, and per-stage times from the caller's
+ * clock. 0 (the default) compiles all of it out. */
+#ifndef FJPEG_STATS
+#define FJPEG_STATS 0
+#endif
+
 /*--- Types ---*/
 
+/* Profiling stages for FJPEG_STAGE, in fjpeg_stats_t.ticks order */
+enum {
+    STAGE_PARSE = FJPEG_STAGE_PARSE, STAGE_HUFF = FJPEG_STAGE_HUFF,
+    STAGE_IDCT = FJPEG_STAGE_IDCT, STAGE_COLOR = FJPEG_STAGE_COLOR,
+    STAGE_OUTPUT = FJPEG_STAGE_OUTPUT, STAGE_COUNT = FJPEG_STAGES
+};
+
+#if FJPEG_BITBUF_BITS == 64
+typedef uint64_t bitbuf_t;
+#elif FJPEG_BITBUF_BITS == 32
+typedef uint32_t bitbuf_t;
+#else
+#error "FJPEG_BITBUF_BITS must be 32 or 64"
+#endif
+
 typedef struct {
     uint16_t min_code[16];
     uint16_t max_code[16];
     uint8_t  val_ptr[16];
+#if FJPEG_HUFF_LOOKAHEAD
+    uint16_t look[1 << FJPEG_HUFF_LOOKAHEAD];  /* (length << 8) | symbol, 0 = long code */
+#endif
 } huff_table_t;
 
 typedef struct {
     size_t pos;
-    uint32_t bits;
+    bitbuf_t bits;
     int nbits;
+    uint8_t zfill, corrupt, resync;
     int16_t last_dc[3];
     uint16_t restarts_left;
     uint8_t next_restart;
+    uint32_t lost;
 } decode_save_t;
 
+/* Sparsity class of a block, from its last nonzero zigzag index */
+enum { IDCT_DC, IDCT_2X2, IDCT_4X4, IDCT_FULL, IDCT_CLASSES };
+
+/* Row color converter: w pixels from planar Y/Cb/Cr to one output row */
+typedef void (*convert_fn)(const uint8_t *restrict y, const uint8_t *restrict cb,
+                           const uint8_t *restrict cr, uint8_t *restrict out, int w);
+
+/* Chroma upsampler: n samples of one row (and its vertical neighbour)
+ * to one full-resolution row */
+typedef void (*up_fn)(const uint8_t *restrict near, const uint8_t *restrict far,
+                      uint8_t *restrict out, int n);
+
+/* IDCT kernel table, chosen once per decode by idct_select().
+ * kern[] maps a dequantized 8x8 block to 8x8 pixels; half and quarter
+ * are the reduced-size transforms for 1/2 and 1/4 scale. */
 typedef struct {
-    /* Input */
+    void (*kern[IDCT_CLASSES])(int16_t *blk, uint8_t *out);
+    void (*half)(const int16_t *blk, uint8_t *out);     /* 4x4 pixels */
+    void (*quarter)(const int16_t *blk, uint8_t *out);  /* 2x2 pixels */
+} idct_ops_t;
+
+/* Output rows or tiles: n buffers of size bytes in rotation, i the next
+ * one, wrapped once all have been handed out */
+typedef struct {
+    uint8_t *buf;
+    uint32_t size;
+    uint8_t n, i, wrapped;
+} fjrot_t;
+
+typedef struct {
+    /* Input: data[pos] is byte base + pos of the file */
     const uint8_t *data;
     size_t len;
     size_t pos;
+    size_t base;
 
-    /* Bit reader */
-    uint32_t bits;
+    /* Pull input: data is a window of win_size bytes refilled by read */
+    fjpeg_read_cb read;
+    void *read_user;
+    uint8_t *win;
+    size_t win_size;
+
+    /* Bit reader: MSB-aligned, nbits valid. zfill counts the zero bytes
+     * fed in at a marker, which have no place in the file; corrupt is set
+     * by an invalid Huffman code, or by an RSTn out of order or not where
+     * the interval ended. */
+    bitbuf_t bits;
     int nbits;
+    uint8_t zfill;
+    uint8_t corrupt;
+
+    /* FJPEG_CONCEAL: the next lost MCUs are filled in instead of decoded,
+     * and damaged records that any were. resync is set when the rest of
+     * an interval was given up, whose bytes the next RSTn passes over. */
+    uint8_t conceal, damaged, resync;
+    uint32_t lost;
+
+    /* MCU-row index entries from the caller, or NULL */
+    const uint8_t *index;
 
     /* Image */
     uint16_t width, height;
@@ -48,20 +247,28 @@ typedef struct {
     uint8_t comp_qtab[3];        /* quantization table index per component */
     uint8_t comp_dc[3];          /* DC Huffman table index */
     uint8_t comp_ac[3];          /* AC Huffman table index */
+    uint8_t comp_id[3];          /* component IDs from SOF, matched by SOS */
     int16_t last_dc[3];          /* previous DC value per component */
 
+    /* Current scan: components in scan order, spectral band ss..se and
+     * successive approximation bits ah/al (progressive only) */
+    uint8_t scan_n, scan_comp[3];
+    uint8_t ss, se, ah, al;
+    uint16_t eobrun;             /* blocks left in an end-of-band run */
+
+    /* Progressive: every scan lands in a coefficient store of ncoef
+     * zigzag-ordered coefficients per block (DC only at 1/8), coef_w
+     * blocks across per component; output then reads row mcu_row */
+    uint8_t progressive;
+    uint8_t ncoef;
+    int16_t *coefs[3];
+    uint16_t coef_w[3];
+    uint16_t mcu_row;
+
     /* MCU geometry */
     uint8_t mcu_w, mcu_h;       /* pixels: 8 or 16 */
     uint16_t mcus_x, mcus_y;
 
-    /* Quantization tables (2), pre-scaled for Winograd IDCT */
-    int16_t qtab[2][64];
-
-    /* Huffman tables: 0-1 = DC, 2-3 = AC */
-    huff_table_t huff[4];
-    uint8_t dc_vals[2][16];
-    uint8_t ac_vals[2][256];
-
     /* Restart interval */
     uint16_t restart_interval;
     uint16_t restarts_left;
@@ -70,10 +277,146 @@ typedef struct {
     /* Scale factor */
     uint8_t scale;
 
-    /* Work buffer */
+    /* Output geometry */
+    uint16_t out_w, out_h;
+    uint8_t out_mcu_h;           /* output rows per MCU row */
+    uint8_t buf_rows;            /* rows per decode_mcu_row() call */
+    uint8_t ny_h, ny_v;          /* Y blocks per MCU */
+    uint8_t h_shift, v_shift;    /* chroma subsampling shifts */
+
+    /* Planes at native sampling: Y holds buf_rows rows of ystride bytes,
+     * Cb and Cr one block row of cstride bytes (a block side per MCU).
+     * Vertical fancy upsampling keeps the previous MCU row's last row
+     * just above each plane. Rows are upsampled into cbup/crup and
+     * converted a row at a time to bpp bytes per pixel. */
+    uint8_t *ybuf, *cbbuf, *crbuf, *cbup, *crup;
+    up_fn upsample;              /* NULL when chroma rows are used as is */
+    uint16_t up_n;               /* chroma samples per upsampled row */
+    uint32_t ystride, cstride;
+    uint8_t bs;                  /* block side in output pixels: 8/scale, 1 at 1/8 */
+    uint8_t mcu_loop;            /* mcu_loops[] entry */
+
+    /* Crop window in output pixels. Planes hold MCU columns mx0..mx1-1
+     * and rows are converted from plane column ox. */
+    uint16_t roi_y, roi_w, roi_h;
+    uint16_t mx0, mx1, ox;
+    uint8_t fancy;               /* FJPEG_FANCY_UPSAMPLING */
+    uint8_t need_chroma;         /* the output format reads Cb/Cr */
+    convert_fn convert;
+    uint8_t bpp;
+
+    /* Output rows or tiles */
+    fjrot_t out;
+
+    /* FJPEG_PIPELINE ring the calling thread reconstructs MCUs from,
+     * or NULL when it entropy-decodes them itself */
+    struct fjpipe *pipe;
+
+    /* IDCT kernels; accurate selects islow and plain tables */
+    const idct_ops_t *idct;
+    uint8_t accurate;
+
+    /* Work buffer, kept all zero between blocks */
     int16_t block[64];
+
+    /* Decoded pixels of one block, bs * bs bytes */
+    uint8_t pix[64];
+
+#if FJPEG_STATS
+    /* Counts for fjpeg_opts_t.stats; stage has been timed since stage_t0 */
+    fjpeg_stats_t stats;
+    uint64_t stage_t0;
+    uint8_t stage;
+#endif
+
+    /* Tables last: with FJPEG_KEEP_TABLES everything from qtab on is
+     * left from the previous frame (see decode_setup()) */
+
+    /* Quantization tables (2), pre-scaled for Winograd IDCT unless
+     * accurate */
+    int16_t qtab[2][64];
+
+    /* Huffman tables: 0-1 = DC, 2-3 = AC. huff_counts holds each table's
+     * DHT code counts, so a repeated DHT is recognized and not rebuilt;
+     * bit t of huff_set means huff[t] holds a table. */
+    huff_table_t huff[4];
+    uint8_t huff_counts[4][16];
+    uint8_t huff_set;
+    uint8_t dc_vals[2][16];
+    uint8_t ac_vals[2][256];
+#if FJPEG_HUFF_LOOKAHEAD
+    /* Fused AC lookup: (value << 8) | (run << 4) | total_bits, 0 = no fit */
+    int16_t fast_ac[2][1 << FJPEG_HUFF_LOOKAHEAD];
+#endif
 } fjctx_t;
 
+/* Scratch pieces start 8-byte aligned */
+#define WORK_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/*--- Statistics ---*/
+
+#if FJPEG_STATS
+/* Charge the ticks since the last stage change to the stage that ran,
+ * and time s from now on */
+static void stats_stage(fjctx_t *c, int s)
+{
+    if (c->stats.clock) {
+        uint64_t t = c->stats.clock(c->stats.clock_user);
+        c->stats.ticks[c->stage] += t - c->stage_t0;
+        c->stage_t0 = t;
+    }
+    c->stage = (uint8_t)s;
+}
+
+/* Zero the counts, keeping the caller's clock */
+static void stats_clear(fjpeg_stats_t *st)
+{
+    uint64_t (*clock)(void *) = st->clock;
+    void *clock_user = st->clock_user;
+    memset(st, 0, sizeof(*st));
+    st->clock = clock;
+    st->clock_user = clock_user;
+}
+
+/* Start counting in c from zero, timing from now */
+static void stats_start(fjctx_t *c, uint64_t (*clock)(void *), void *clock_user)
+{
+    c->stats.clock = clock;
+    c->stats.clock_user = clock_user;
+    stats_clear(&c->stats);
+    c->stage = STAGE_PARSE;
+    c->stage_t0 = clock ? clock(clock_user) : 0;
+}
+
+/* Fold the counts of j, a worker's copy of the context, into c. bytes
+ * is how far into the file any of them got. */
+static void stats_merge(fjctx_t *c, const fjctx_t *j)
+{
+    c->stats.blocks += j->stats.blocks;
+    c->stats.dc_only += j->stats.dc_only;
+    c->stats.sparse += j->stats.sparse;
+    c->stats.restarts += j->stats.restarts;
+    c->stats.stuffed += j->stats.stuffed;
+    c->stats.huff_slow += j->stats.huff_slow;
+    for (int i = 0; i < STAGE_COUNT; i++)
+        c->stats.ticks[i] += j->stats.ticks[i];
+    if (j->base + j->pos > c->stats.bytes) c->stats.bytes = j->base + j->pos;
+}
+
+static void stats_finish(fjctx_t *c, fjpeg_stats_t *out)
+{
+    stats_stage(c, c->stage);
+    if (c->base + c->pos > c->stats.bytes) c->stats.bytes = c->base + c->pos;
+    *out = c->stats;
+}
+
+#define STAGE(c, s) (stats_stage(c, s), FJPEG_STAGE(s))
+#define STAT_ADD(c, field, n) ((c)->stats.field += (n))
+#else
+#define STAGE(c, s) FJPEG_STAGE(s)
+#define STAT_ADD(c, field, n) ((void)0)
+#endif
+
 /*--- Zigzag order ---*/
 
 static const uint8_t zag[64] = {
@@ -102,9 +445,33 @@ static const uint8_t wquant[64] = {
 
 /*--- Byte/bit reading ---*/
 
+/* Pull input: drop consumed bytes from the window, keeping the last two
+ * for next_byte's marker push-back, and read until n bytes are ready */
+static int fill_window(fjctx_t *c, size_t n)
+{
+    size_t drop = c->pos > 2 ? c->pos - 2 : 0;
+    memmove(c->win, c->win + drop, c->len - drop);
+    c->len -= drop;
+    c->pos -= drop;
+    c->base += drop;
+    while (c->pos + n > c->len) {
+        size_t got = c->read(c->win + c->len, c->win_size - c->len, c->read_user);
+        if (got == 0) return 0;
+        c->len += got;
+    }
+    return 1;
+}
+
+/* Are n more bytes available at pos? */
+static inline int avail(fjctx_t *c, size_t n)
+{
+    if (c->pos + n <= c->len) return 1;
+    return c->read ? fill_window(c, n) : 0;
+}
+
 static uint8_t read_u8(fjctx_t *c)
 {
-    if (c->pos < c->len) return c->data[c->pos++];
+    if (avail(c, 1)) return c->data[c->pos++];
     return 0;
 }
 
@@ -114,74 +481,191 @@ static uint16_t read_u16(fjctx_t *c)
     return (hi << 8) | read_u8(c);
 }
 
-/* Get next byte from entropy-coded data, handling 0xFF byte stuffing */
+/* Get next byte from entropy-coded data, handling 0xFF byte stuffing.
+ * Past a marker or the end of the data it feeds zeros. */
 static uint8_t next_byte(fjctx_t *c)
 {
-    uint8_t b = read_u8(c);
+    if (!avail(c, 1)) {
+        if (c->zfill < 255) c->zfill++;
+        return 0;
+    }
+    uint8_t b = c->data[c->pos++];
     if (b == 0xFF) {
         uint8_t marker = read_u8(c);
         if (marker != 0) {
             /* Unexpected marker in entropy data — push back for restart handling */
             c->pos -= 2;
+            if (c->zfill < 255) c->zfill++;
             return 0;
         }
+        STAT_ADD(c, stuffed, 1);
     }
     return b;
 }
 
-static void fill_bits(fjctx_t *c)
+#define BITBUF_ONES ((bitbuf_t)-1 / 0xFF)  /* 0x0101...01 */
+
+/* Big-endian word load; compilers turn this into a load + byte swap */
+static bitbuf_t load_be(const uint8_t *p)
+{
+    bitbuf_t w = 0;
+    for (size_t i = 0; i < sizeof(bitbuf_t); i++)
+        w = (w << 8) | p[i];
+    return w;
+}
+
+/* Load as many whole bytes as fit into the bit buffer */
+static void refill_bits(fjctx_t *c)
 {
-    while (c->nbits <= 24) {
-        c->bits |= (uint32_t)next_byte(c) << (24 - c->nbits);
+    /* Fast path: the next word holds no 0xFF, so no stuffing or marker */
+    if (c->pos + sizeof(bitbuf_t) <= c->len) {
+        bitbuf_t w = load_be(c->data + c->pos);
+        if (!((~w - BITBUF_ONES) & w & (BITBUF_ONES << 7))) {
+            int n = (FJPEG_BITBUF_BITS - c->nbits) >> 3;  /* whole bytes that fit */
+            c->bits |= (w >> (FJPEG_BITBUF_BITS - 8 * n)) << (FJPEG_BITBUF_BITS - 8 * n - c->nbits);
+            c->nbits += 8 * n;
+            c->pos += n;
+            return;
+        }
+    }
+
+    /* Near 0xFF or the end of the buffer: byte at a time */
+    while (c->nbits <= FJPEG_BITBUF_BITS - 8) {
+        c->bits |= (bitbuf_t)next_byte(c) << (FJPEG_BITBUF_BITS - 8 - c->nbits);
         c->nbits += 8;
     }
 }
 
+/* Refill threshold: a 64-bit buffer waits until it is half empty so each
+ * refill moves at least 4 bytes. Either way at least 25 bits remain after
+ * fill_bits, enough for any Huffman code or any value. */
+#define BITBUF_LOW (FJPEG_BITBUF_BITS == 64 ? 31 : 24)
+
+static inline void fill_bits(fjctx_t *c)
+{
+    if (c->nbits <= BITBUF_LOW) refill_bits(c);
+}
+
+/* An invalid code or an out-of-order RSTn went by, or the decode has
+ * used zero fill: entropy data never runs into a marker or the end */
+static inline int stream_bad(const fjctx_t *c)
+{
+    return c->corrupt || c->zfill * 8 > c->nbits;
+}
+
 static uint16_t get_bits(fjctx_t *c, int n)
 {
     if (n == 0) return 0;
     fill_bits(c);
-    uint16_t val = (uint16_t)(c->bits >> (32 - n));
+    uint16_t val = (uint16_t)(c->bits >> (FJPEG_BITBUF_BITS - n));
     c->bits <<= n;
     c->nbits -= n;
     return val;
 }
 
+#if !FJPEG_HUFF_LOOKAHEAD
 static uint8_t get_bit(fjctx_t *c)
 {
     fill_bits(c);
-    uint8_t val = (c->bits >> 31) & 1;
+    uint8_t val = (c->bits >> (FJPEG_BITBUF_BITS - 1)) & 1;
     c->bits <<= 1;
     c->nbits -= 1;
     return val;
 }
+#endif
 
 /*--- Huffman ---*/
 
-static void huff_build(const uint8_t *counts, huff_table_t *ht)
+/* Build the decode tables. Returns -1 if the counts ask for more codes
+ * of some length than there are left, which no canonical code does. */
+static int huff_build(const uint8_t *counts, const uint8_t *vals, huff_table_t *ht)
 {
-    uint16_t code = 0;
+    uint32_t code = 0;
     uint8_t j = 0;
     for (int i = 0; i < 16; i++) {
+        if (code + counts[i] > (1u << (i + 1))) return -1;
         if (counts[i] == 0) {
             ht->min_code[i] = 0;
             ht->max_code[i] = 0xFFFF;
             ht->val_ptr[i] = 0;
         } else {
-            ht->min_code[i] = code;
-            ht->max_code[i] = code + counts[i] - 1;
+            ht->min_code[i] = (uint16_t)code;
+            ht->max_code[i] = (uint16_t)(code + counts[i] - 1);
             ht->val_ptr[i] = j;
             j += counts[i];
             code += counts[i];
         }
         code <<= 1;
     }
+
+#if FJPEG_HUFF_LOOKAHEAD
+    /* Every code of length l <= N owns 2^(N-l) consecutive lookahead slots */
+    memset(ht->look, 0, sizeof(ht->look));
+    for (int l = 1; l <= FJPEG_HUFF_LOOKAHEAD; l++) {
+        if (ht->max_code[l - 1] == 0xFFFF) continue;
+        int fill = FJPEG_HUFF_LOOKAHEAD - l;
+        for (uint16_t cd = ht->min_code[l - 1]; cd <= ht->max_code[l - 1]; cd++) {
+            uint16_t entry = (uint16_t)((l << 8) | vals[ht->val_ptr[l - 1] + cd - ht->min_code[l - 1]]);
+            for (int k = 0; k < (1 << fill); k++)
+                ht->look[(cd << fill) | k] = entry;
+        }
+    }
+#else
+    (void)vals;
+#endif
+    return 0;
+}
+
+#if FJPEG_HUFF_LOOKAHEAD
+/* Fold run, size and the sign-extended value of short AC codes into one
+ * entry, so a whole coefficient decodes with one peek and one shift. */
+static void huff_build_fast_ac(const huff_table_t *ht, int16_t *fast)
+{
+    for (int i = 0; i < (1 << FJPEG_HUFF_LOOKAHEAD); i++) {
+        fast[i] = 0;
+        uint16_t e = ht->look[i];
+        if (!e) continue;
+        int len = e >> 8;
+        int run = (e >> 4) & 0x0F;
+        int size = e & 0x0F;
+        if (size == 0 || len + size > FJPEG_HUFF_LOOKAHEAD) continue;
+        int v = (i << len) & ((1 << FJPEG_HUFF_LOOKAHEAD) - 1);
+        v >>= FJPEG_HUFF_LOOKAHEAD - size;
+        if (v < (1 << (size - 1))) v -= (1 << size) - 1;
+        if (v >= -128 && v <= 127)
+            fast[i] = (int16_t)(v * 256 + (run << 4) + len + size);
+    }
 }
+#endif
 
 static uint8_t huff_decode(fjctx_t *c, int table)
 {
     huff_table_t *ht = &c->huff[table];
     const uint8_t *vals = (table < 2) ? c->dc_vals[table] : c->ac_vals[table - 2];
+#if FJPEG_HUFF_LOOKAHEAD
+    fill_bits(c);
+    uint16_t e = ht->look[c->bits >> (FJPEG_BITBUF_BITS - FJPEG_HUFF_LOOKAHEAD)];
+    if (e) {
+        c->bits <<= e >> 8;
+        c->nbits -= e >> 8;
+        return (uint8_t)e;
+    }
+    /* Long code: fill_bits guarantees at least 25 bits, enough for 16 */
+    STAT_ADD(c, huff_slow, 1);
+    for (int i = FJPEG_HUFF_LOOKAHEAD; i < 16; i++) {
+        uint16_t code = (uint16_t)(c->bits >> (FJPEG_BITBUF_BITS - 1 - i));
+        if (code <= ht->max_code[i] && ht->max_code[i] != 0xFFFF) {
+            c->bits <<= i + 1;
+            c->nbits -= i + 1;
+            return vals[ht->val_ptr[i] + (uint8_t)(code - ht->min_code[i])];
+        }
+    }
+    c->bits <<= 16;
+    c->nbits -= 16;
+    c->corrupt = 1;
+    return 0;
+#else
+    STAT_ADD(c, huff_slow, 1);
     uint16_t code = get_bit(c);
     for (int i = 0; i < 16; i++) {
         if (code <= ht->max_code[i] && ht->max_code[i] != 0xFFFF) {
@@ -190,9 +674,90 @@ static uint8_t huff_decode(fjctx_t *c, int table)
         }
         code = (code << 1) | get_bit(c);
     }
+    c->corrupt = 1;
+    return 0;
+#endif
+}
+
+/* Install a Huffman table of n values, unless huff[table] already holds
+ * the same one. Returns -1 for an invalid table, leaving the slot unset. */
+static int set_huff(fjctx_t *c, int table, const uint8_t *counts, const uint8_t *vals, int n)
+{
+    uint8_t *dst = table < 2 ? c->dc_vals[table] : c->ac_vals[table - 2];
+    if ((c->huff_set >> table & 1) && !memcmp(c->huff_counts[table], counts, 16) &&
+        !memcmp(dst, vals, n))
+        return 0;
+    c->huff_set &= (uint8_t)~(1 << table);
+    memcpy(c->huff_counts[table], counts, 16);
+    memcpy(dst, vals, n);
+    if (huff_build(counts, dst, &c->huff[table]) != 0) return -1;
+#if FJPEG_HUFF_LOOKAHEAD
+    if (table >= 2) huff_build_fast_ac(&c->huff[table], c->fast_ac[table - 2]);
+#endif
+    c->huff_set |= (uint8_t)(1 << table);
     return 0;
 }
 
+/* Standard tables from JPEG Annex K.3, for streams that leave out DHT
+ * (motion JPEG in the AVI1 convention): luminance as 0, chrominance as 1 */
+static const uint8_t std_dc_counts[2][16] = {
+    { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+};
+static const uint8_t std_dc_vals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const uint8_t std_ac_counts[2][16] = {
+    { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D },
+    { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 },
+};
+static const uint8_t std_ac_vals[2][162] = {
+    {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+        0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08,
+        0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0, 0x24, 0x33, 0x62, 0x72,
+        0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45,
+        0x46, 0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+        0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73, 0x74, 0x75,
+        0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+        0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3,
+        0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+        0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9,
+        0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+        0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4,
+        0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA,
+    },
+    {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+        0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+        0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0, 0x15, 0x62, 0x72, 0xD1,
+        0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+        0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44,
+        0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+        0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73, 0x74,
+        0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A,
+        0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4,
+        0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7,
+        0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+        0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4,
+        0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA,
+    },
+};
+
+/* Give every table the scan uses a definition, falling back to the
+ * standard one for tables no DHT has set */
+static void default_huff(fjctx_t *c)
+{
+    for (int i = 0; i < c->scan_n; i++) {
+        int comp = c->scan_comp[i];
+        int dc = c->comp_dc[comp], ac = c->comp_ac[comp];
+        if (!(c->huff_set >> dc & 1))
+            (void)set_huff(c, dc, std_dc_counts[dc], std_dc_vals, 12);
+        if (!(c->huff_set >> (ac + 2) & 1))
+            (void)set_huff(c, ac + 2, std_ac_counts[ac], std_ac_vals[ac], 162);
+    }
+}
+
 /* Sign-extend a Huffman-decoded value */
 static int16_t huff_extend(uint16_t val, uint8_t bits)
 {
@@ -204,6 +769,18 @@ static int16_t huff_extend(uint16_t val, uint8_t bits)
 
 /*--- Marker parsing ---*/
 
+/* Sampling layouts the MCU loops handle: Y at up to 2x2 over one block
+ * each of Cb and Cr. Grayscale has one block per MCU whatever its
+ * (nonzero) factors say. */
+static int valid_sampling(int ncomp, const uint8_t *hsamp, const uint8_t *vsamp)
+{
+    if (ncomp == 1) return hsamp[0] && vsamp[0];
+    if (hsamp[0] < 1 || hsamp[0] > 2 || vsamp[0] < 1 || vsamp[0] > 2) return 0;
+    for (int i = 1; i < 3; i++)
+        if (hsamp[i] != 1 || vsamp[i] != 1) return 0;
+    return 1;
+}
+
 static int parse_dqt(fjctx_t *c)
 {
     uint16_t left = read_u16(c) - 2;
@@ -211,15 +788,17 @@ static int parse_dqt(fjctx_t *c)
         uint8_t info = read_u8(c);
         uint8_t prec = info >> 4;
         uint8_t id = info & 0x0F;
-        if (id > 1) return -1;
+        if (id > 1 || left < 65 + (prec ? 64 : 0)) return -1;
         for (int i = 0; i < 64; i++) {
             int16_t val = read_u8(c);
             if (prec) val = (val << 8) | read_u8(c);
             c->qtab[id][i] = val;
         }
-        /* Pre-multiply by Winograd scale factors */
+        /* Pre-multiply by Winograd scale factors. The accurate IDCT
+         * takes plain AC entries; the DC is x16 (wquant[0] / 8) either
+         * way, for the DC-only paths. */
         for (int i = 0; i < 64; i++) {
-            long x = (long)c->qtab[id][i] * wquant[i];
+            long x = (long)c->qtab[id][i] * (c->accurate && i ? 8 : wquant[i]);
             c->qtab[id][i] = (int16_t)((x + (1 << 2)) >> 3);
         }
         left -= 65 + (prec ? 64 : 0);
@@ -236,23 +815,20 @@ static int parse_dht(fjctx_t *c)
         uint8_t id = info & 1;
         int table = cls * 2 + id;
 
-        uint8_t counts[16];
+        uint8_t counts[16], vals[256];
         uint16_t total = 0;
         for (int i = 0; i < 16; i++) {
             counts[i] = read_u8(c);
             total += counts[i];
         }
 
-        /* Store values in split tables: DC→dc_vals, AC→ac_vals */
-        uint8_t *dst = (cls == 0) ? c->dc_vals[id] : c->ac_vals[id];
-        int max = (cls == 0) ? 16 : 256;
-        for (int i = 0; i < total && i < max; i++)
-            dst[i] = read_u8(c);
-        /* Skip excess values that don't fit */
-        for (int i = max; i < total; i++)
-            read_u8(c);
+        /* Values go to split tables: DC→dc_vals, AC→ac_vals. A DC
+         * difference has at most 16 categories. */
+        if (total > (cls == 0 ? 16 : 256) || 17 + total > left) return -1;
+        for (int i = 0; i < total; i++)
+            vals[i] = read_u8(c);
 
-        huff_build(counts, &c->huff[table]);
+        if (set_huff(c, table, counts, vals, total) != 0) return -1;
         left -= 17 + total;
     }
     return 0;
@@ -268,12 +844,14 @@ static int parse_sof(fjctx_t *c)
     if (c->ncomp != 1 && c->ncomp != 3) return -1;
 
     for (int i = 0; i < c->ncomp; i++) {
-        read_u8(c); /* component ID — ignored, assume sequential */
+        c->comp_id[i] = read_u8(c);
         uint8_t samp = read_u8(c);
         c->hsamp[i] = samp >> 4;
         c->vsamp[i] = samp & 0x0F;
         c->comp_qtab[i] = read_u8(c);
+        if (c->comp_qtab[i] > 1) return -1;  /* only tables 0 and 1 are kept */
     }
+    if (!valid_sampling(c->ncomp, c->hsamp, c->vsamp)) return -1;
 
     /* MCU size */
     if (c->ncomp == 1) {
@@ -292,15 +870,39 @@ static int parse_sos(fjctx_t *c)
     uint16_t left = read_u16(c) - 2;
     uint8_t ns = read_u8(c);
     left--;
+    if (ns == 0 || ns > 3 || (!c->progressive && ns != c->ncomp)) return -1;
     for (int i = 0; i < ns; i++) {
-        uint8_t id = read_u8(c); (void)id;
+        /* Baseline scans carry every component in SOF order; progressive
+         * ones name theirs by ID */
+        uint8_t id = read_u8(c);
+        int comp = c->progressive ? 3 : i;
+        for (int j = 0; j < c->ncomp && c->progressive; j++)
+            if (c->comp_id[j] == id) comp = j;
         uint8_t tab = read_u8(c);
-        c->comp_dc[i] = tab >> 4;
-        c->comp_ac[i] = (tab & 0x0F);
+        if ((tab >> 4) > 1 || (tab & 0x0F) > 1) return -1;  /* baseline: 0 or 1 */
+        if (comp >= 3) return -1;
+        c->scan_comp[i] = (uint8_t)comp;
+        c->comp_dc[comp] = tab >> 4;
+        c->comp_ac[comp] = (tab & 0x0F);
         left -= 2;
     }
-    /* Skip spectral selection and successive approximation */
+    c->scan_n = ns;
+    c->ss = read_u8(c);
+    c->se = read_u8(c);
+    uint8_t a = read_u8(c);
+    c->ah = a >> 4;
+    c->al = a & 0x0F;
+    left -= 3;
     while (left > 0) { read_u8(c); left--; }
+
+    /* Progressive: a DC scan (0..0) may interleave, a band of AC within
+     * one component may not */
+    if (c->progressive) {
+        if (c->se > 63 || c->ss > c->se || (c->ss == 0) != (c->se == 0) ||
+            (c->ss && ns != 1) || c->al > 13)
+            return -1;
+    }
+    default_huff(c);
     return 0;
 }
 
@@ -314,32 +916,49 @@ static int parse_dri(fjctx_t *c)
 static void skip_marker(fjctx_t *c)
 {
     uint16_t len = read_u16(c);
-    if (len >= 2) c->pos += len - 2;
+    if (len < 2) return;
+    size_t n = len - 2;
+    /* Pull input: the segment may be longer than what is buffered */
+    while (c->read && c->pos + n > c->len) {
+        n -= c->len - c->pos;
+        c->pos = c->len;
+        if (!fill_window(c, 1)) return;
+    }
+    c->pos += n;
 }
 
-static int parse_markers(fjctx_t *c)
+/* Parse markers up to the next scan: 0 at SOS, 1 at EOI or the end of
+ * the data, -1 on a bad segment */
+static int parse_tables(fjctx_t *c)
 {
-    /* Find SOI */
-    if (read_u8(c) != 0xFF || read_u8(c) != 0xD8) return -1;
-
-    while (c->pos < c->len) {
+    while (avail(c, 1)) {
         uint8_t b = read_u8(c);
         if (b != 0xFF) continue;
         do { b = read_u8(c); } while (b == 0xFF);
         if (b == 0) continue;
 
         switch (b) {
-            case 0xC0: if (parse_sof(c)) return -1; break;
+            case 0xC0:
+            case 0xC2:
+                if (c->ncomp || parse_sof(c)) return -1;  /* one frame only */
+                c->progressive = b == 0xC2;
+                break;
             case 0xC4: if (parse_dht(c)) return -1; break;
             case 0xDB: if (parse_dqt(c)) return -1; break;
             case 0xDD: if (parse_dri(c)) return -1; break;
             case 0xDA: if (parse_sos(c)) return -1; return 0; /* SOS = start of data */
-            case 0xD9: return -1; /* EOI before SOS */
-            case 0xC2: return -1; /* progressive not supported */
+            case 0xD9: return 1;
             default: skip_marker(c); break;
         }
     }
-    return -1;
+    return 1;
+}
+
+static int parse_markers(fjctx_t *c)
+{
+    /* Find SOI */
+    if (read_u8(c) != 0xFF || read_u8(c) != 0xD8) return -1;
+    return parse_tables(c) == 0 ? 0 : -1;  /* EOI before SOS */
 }
 
 /*--- Winograd IDCT ---*/
@@ -354,6 +973,12 @@ static int16_t imul_669(int16_t w) { return (int16_t)(((long)w * 669 + 128) >> 8
 static int16_t imul_277(int16_t w) { return (int16_t)(((long)w * 277 + 128) >> 8); }
 static int16_t imul_196(int16_t w) { return (int16_t)(((long)w * 196 + 128) >> 8); }
 
+/* Reduced-size IDCT constants: cos(pi/8), cos(pi/4), cos(3pi/8), cos(pi/8)cos(pi/4) */
+static int16_t imul_237(int16_t w) { return (int16_t)(((long)w * 237 + 128) >> 8); }
+static int16_t imul_181(int16_t w) { return (int16_t)(((long)w * 181 + 128) >> 8); }
+static int16_t imul_98(int16_t w)  { return (int16_t)(((long)w * 98 + 128) >> 8); }
+static int16_t imul_167(int16_t w) { return (int16_t)(((long)w * 167 + 128) >> 8); }
+
 static uint8_t clamp8(int16_t x)
 {
     if (x < 0) return 0;
@@ -424,396 +1049,3687 @@ static void idct_cols(int16_t *b, uint8_t *out)
     }
 }
 
-/*--- Block decoding ---*/
-
-static int decode_block(fjctx_t *c, int comp, uint8_t *pixels)
+static void idct_8x8_scalar(int16_t *b, uint8_t *out)
 {
-    int16_t *blk = c->block;
-    memset(blk, 0, sizeof(c->block));
-
-    int qtab = c->comp_qtab[comp];
-    const int16_t *q = c->qtab[qtab];
+    idct_rows(b);
+    idct_cols(b, out);
+}
 
-    /* DC coefficient */
-    int dc_tab = c->comp_dc[comp];
-    uint8_t s = huff_decode(c, dc_tab);
-    uint8_t nbits = s & 0x0F;
-    int16_t dc = huff_extend(get_bits(c, nbits), nbits);
-    dc += c->last_dc[comp];
-    c->last_dc[comp] = dc;
-    blk[0] = dc * q[0];
+/*--- Sparse IDCT ---*/
 
-    /* AC coefficients */
-    int ac_tab = c->comp_ac[comp] + 2;
-    for (int k = 1; k < 64; k++) {
-        s = huff_decode(c, ac_tab);
-        uint8_t run = s >> 4;
-        uint8_t size = s & 0x0F;
-        if (size == 0) {
-            if (run == 15) { k += 15; continue; } /* ZRL: skip 16 zeros */
-            break; /* EOB */
-        }
-        k += run;
-        if (k >= 64) return -1;
-        int16_t ac = huff_extend(get_bits(c, size), size);
-        blk[zag[k]] = ac * q[k];
-    }
+/* The idct_rows/idct_cols butterfly on v0..v7. Sparse kernels pass literal
+ * zeros for coefficients known to be zero and the compiler folds them away;
+ * since imul_*(0) is 0 the results stay bit-exact with the full transform. */
+#define IDCT_BUTTERFLY(v0, v1, v2, v3, v4, v5, v6, v7) \
+    int16_t x4=(v5)-(v3), x7=(v5)+(v3); \
+    int16_t x5=(v1)+(v7), x6=(v1)-(v7); \
+    int16_t t1=imul_196(x4-x6); \
+    int16_t st26=imul_277(x6)-t1; \
+    int16_t x24=t1-imul_669(x4); \
+    int16_t x15=x5-x7, x17=x5+x7; \
+    int16_t t2=st26-x17; \
+    int16_t t3=imul_362(x15)-t2; \
+    int16_t x44=t3+x24; \
+    int16_t x30=(v0)+(v4), x31=(v0)-(v4); \
+    int16_t x12=(v2)-(v6), x13=(v2)+(v6); \
+    int16_t x32=imul_362(x12)-x13; \
+    int16_t x40=x30+x13, x43=x30-x13; \
+    int16_t x41=x31+x32, x42=x31-x32
 
-    /* IDCT */
-    idct_rows(blk);
-    idct_cols(blk, pixels);
-    return 0;
+static inline void idct_row2(int16_t *b)
+{
+    IDCT_BUTTERFLY(b[0], b[1], 0, 0, 0, 0, 0, 0);
+    b[0]=x40+x17; b[1]=x41+t2; b[2]=x42+t3; b[3]=x43-x44;
+    b[4]=x43+x44; b[5]=x42-t3; b[6]=x41-t2; b[7]=x40-x17;
 }
 
-/*--- DC-only block decode (1/8 scale) ---*/
-
-static int decode_block_dc_only(fjctx_t *c, int comp, uint8_t *pixel_out)
+static inline void idct_col2(const int16_t *b, uint8_t *out)
 {
-    int qtab = c->comp_qtab[comp];
-    const int16_t *q = c->qtab[qtab];
-
-    /* DC coefficient */
-    int dc_tab = c->comp_dc[comp];
-    uint8_t s = huff_decode(c, dc_tab);
-    uint8_t nbits = s & 0x0F;
-    int16_t dc = huff_extend(get_bits(c, nbits), nbits);
-    dc += c->last_dc[comp];
-    c->last_dc[comp] = dc;
-
-    /* The DC value after dequantization is the block average.
-     * q[0] is pre-scaled for Winograd, so we need to undo that scaling:
-     * raw_dequant = dc * original_qtab[0]
-     * But our qtab is pre-multiplied: qtab[0] = original * wquant[0] / 8
-     * wquant[0] = 128, so qtab[0] = original * 16
-     * After IDCT, each sample = DESCALE(dc * qtab[0]) + 128
-     * For DC-only, all 64 samples would be the same, so this is correct. */
-    *pixel_out = clamp8(DESCALE(dc * q[0]) + 128);
-
-    /* Consume AC coefficients to advance bitstream */
-    int ac_tab = c->comp_ac[comp] + 2;
-    for (int k = 1; k < 64; k++) {
-        s = huff_decode(c, ac_tab);
-        uint8_t run = s >> 4;
-        uint8_t size = s & 0x0F;
-        if (size == 0) {
-            if (run == 15) { k += 15; continue; }
-            break; /* EOB */
-        }
-        k += run;
-        if (k >= 64) return -1;
-        get_bits(c, size); /* skip AC value */
-    }
-    return 0;
+    IDCT_BUTTERFLY(b[0], b[8], 0, 0, 0, 0, 0, 0);
+    out[0*8]=clamp8(DESCALE(x40+x17)+128);
+    out[1*8]=clamp8(DESCALE(x41+t2)+128);
+    out[2*8]=clamp8(DESCALE(x42+t3)+128);
+    out[3*8]=clamp8(DESCALE(x43-x44)+128);
+    out[4*8]=clamp8(DESCALE(x43+x44)+128);
+    out[5*8]=clamp8(DESCALE(x42-t3)+128);
+    out[6*8]=clamp8(DESCALE(x41-t2)+128);
+    out[7*8]=clamp8(DESCALE(x40-x17)+128);
 }
 
-/*--- 1/4 scale: average 8x8 block to 2x2 ---*/
-
-static void block_to_2x2(const uint8_t *blk, uint8_t out[4])
+static inline void idct_row4(int16_t *b)
 {
-    for (int qy = 0; qy < 2; qy++)
-        for (int qx = 0; qx < 2; qx++) {
-            int sum = 0;
-            for (int y = 0; y < 4; y++)
-                for (int x = 0; x < 4; x++)
-                    sum += blk[(qy * 4 + y) * 8 + qx * 4 + x];
-            out[qy * 2 + qx] = (uint8_t)(sum >> 4);
-        }
+    IDCT_BUTTERFLY(b[0], b[1], b[2], b[3], 0, 0, 0, 0);
+    b[0]=x40+x17; b[1]=x41+t2; b[2]=x42+t3; b[3]=x43-x44;
+    b[4]=x43+x44; b[5]=x42-t3; b[6]=x41-t2; b[7]=x40-x17;
 }
 
-/*--- Restart processing ---*/
-
-static void process_restart(fjctx_t *c)
+static inline void idct_col4(const int16_t *b, uint8_t *out)
 {
-    /* Scan for restart marker */
-    c->nbits = 0;
-    c->bits = 0;
-    while (c->pos < c->len - 1) {
-        if (c->data[c->pos] == 0xFF && c->data[c->pos + 1] >= 0xD0 &&
-            c->data[c->pos + 1] <= 0xD7) {
-            c->pos += 2;
-            break;
-        }
-        c->pos++;
-    }
-    c->last_dc[0] = c->last_dc[1] = c->last_dc[2] = 0;
-    c->restarts_left = c->restart_interval;
-    c->next_restart = (c->next_restart + 1) & 7;
+    IDCT_BUTTERFLY(b[0], b[8], b[16], b[24], 0, 0, 0, 0);
+    out[0*8]=clamp8(DESCALE(x40+x17)+128);
+    out[1*8]=clamp8(DESCALE(x41+t2)+128);
+    out[2*8]=clamp8(DESCALE(x42+t3)+128);
+    out[3*8]=clamp8(DESCALE(x43-x44)+128);
+    out[4*8]=clamp8(DESCALE(x43+x44)+128);
+    out[5*8]=clamp8(DESCALE(x42-t3)+128);
+    out[6*8]=clamp8(DESCALE(x41-t2)+128);
+    out[7*8]=clamp8(DESCALE(x40-x17)+128);
 }
 
-/*--- Decoder state save/restore (for two-pass H2V2) ---*/
-
-static void save_state(const fjctx_t *c, decode_save_t *s)
+/* Nonzero coefficients confined to the top-left 4x4 corner: four row
+ * passes, and every column pass sees only four inputs */
+static void idct_4x4(int16_t *b, uint8_t *out)
 {
-    s->pos = c->pos;
-    s->bits = c->bits;
-    s->nbits = c->nbits;
-    s->last_dc[0] = c->last_dc[0];
-    s->last_dc[1] = c->last_dc[1];
-    s->last_dc[2] = c->last_dc[2];
-    s->restarts_left = c->restarts_left;
-    s->next_restart = c->next_restart;
+    for (int i = 0; i < 4; i++) idct_row4(b + i * 8);
+    for (int i = 0; i < 8; i++) idct_col4(b + i, out + i);
 }
 
-static void restore_state(fjctx_t *c, const decode_save_t *s)
+/* Nonzero coefficients confined to the top-left 2x2 corner */
+static void idct_2x2(int16_t *b, uint8_t *out)
 {
-    c->pos = s->pos;
-    c->bits = s->bits;
-    c->nbits = s->nbits;
-    c->last_dc[0] = s->last_dc[0];
-    c->last_dc[1] = s->last_dc[1];
-    c->last_dc[2] = s->last_dc[2];
-    c->restarts_left = s->restarts_left;
-    c->next_restart = s->next_restart;
+    for (int i = 0; i < 2; i++) idct_row2(b + i * 8);
+    for (int i = 0; i < 8; i++) idct_col2(b + i, out + i);
 }
 
-/*--- YCbCr to RGB565 ---*/
-
-static uint16_t ycbcr_to_rgb565(uint8_t Y, uint8_t Cb, uint8_t Cr)
+/* DC only: the whole block is one flat value */
+static void idct_dc(int16_t *b, uint8_t *out)
 {
-    int cr = (int)Cr - 128;
-    int cb = (int)Cb - 128;
-    int r = (int)Y + ((cr * 359) >> 8);
-    int g = (int)Y - ((cb * 88 + cr * 183) >> 8);
-    int b = (int)Y + ((cb * 454) >> 8);
-    if (r < 0) r = 0;
-    if (r > 255) r = 255;
-    if (g < 0) g = 0;
-    if (g > 255) g = 255;
-    if (b < 0) b = 0;
-    if (b > 255) b = 255;
-    return ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+    memset(out, clamp8(DESCALE(b[0]) + 128), 64);
 }
 
-/*--- Main decode ---*/
+/*--- Reduced-size IDCT (1/2 and 1/4 scale) ---*/
 
-int fjpeg_info(const void *data, size_t len, fjpeg_info_t *info)
+/* qtab carries the Winograd scale factors, so a coefficient already holds
+ * F(u,v) * a(u) * a(v) * 16 with a(u) = sqrt(2) * cos(u*pi/16). Averaging
+ * the 8x8 output over 2x2 cells multiplies each basis by cos(u*pi/16),
+ * which cancels against a(u); what is left for u, v < 4 is a plain
+ * unnormalized 4-point cosine sum, descaled by the same /128 as the full
+ * transform. Over 4x4 cells the extra factor is cos(u*pi/8), which is
+ * why the 2-point kernel multiplies by cos(pi/8)cos(pi/4). Higher
+ * frequencies would only alias and are dropped. */
+
+/* Low 4x4 corner -> 4x4 pixels */
+static void idct_half(const int16_t *b, uint8_t *out)
 {
-    const uint8_t *p = data;
-    const uint8_t *end = p + len;
-    if (len < 2 || p[0] != 0xFF || p[1] != 0xD8) return -1;
-    p += 2;
-    while (p + 4 <= end) {
-        if (*p != 0xFF) { p++; continue; }
-        uint8_t marker = p[1];
-        if (marker == 0xC0) {
-            if (p + 9 > end) return -1;
-            info->height = (p[5] << 8) | p[6];
-            info->width  = (p[7] << 8) | p[8];
-            return 0;
-        }
-        if (marker == 0xD9) break;
-        uint16_t mlen = (p[2] << 8) | p[3];
-        p += 2 + mlen;
+    int16_t t[16];
+    for (int i = 0; i < 4; i++, b += 8) {
+        int16_t e0 = b[0] + imul_181(b[2]), e1 = b[0] - imul_181(b[2]);
+        int16_t o0 = imul_237(b[1]) + imul_98(b[3]);
+        int16_t o1 = imul_98(b[1]) - imul_237(b[3]);
+        t[i*4+0] = e0 + o0; t[i*4+1] = e1 + o1;
+        t[i*4+2] = e1 - o1; t[i*4+3] = e0 - o0;
+    }
+    for (int i = 0; i < 4; i++) {
+        const int16_t *c = t + i;
+        int16_t e0 = c[0] + imul_181(c[8]), e1 = c[0] - imul_181(c[8]);
+        int16_t o0 = imul_237(c[4]) + imul_98(c[12]);
+        int16_t o1 = imul_98(c[4]) - imul_237(c[12]);
+        out[0*4+i] = clamp8(DESCALE(e0 + o0) + 128);
+        out[1*4+i] = clamp8(DESCALE(e1 + o1) + 128);
+        out[2*4+i] = clamp8(DESCALE(e1 - o1) + 128);
+        out[3*4+i] = clamp8(DESCALE(e0 - o0) + 128);
     }
-    return -1;
 }
 
-int fjpeg_decode(const void *data, size_t len, int scale,
-                 fjpeg_row_cb cb, void *user)
+/* Low 2x2 corner -> 2x2 pixels */
+static void idct_quarter(const int16_t *b, uint8_t *out)
 {
-    if (scale != 1 && scale != 4 && scale != 8) return -1;
+    int16_t r0 = imul_167(b[1]), r1 = imul_167(b[9]);
+    int16_t a0 = b[0] + r0, a1 = b[0] - r0;  /* row 0 */
+    int16_t b0 = b[8] + r1, b1 = b[8] - r1;  /* row 1 */
+    int16_t c0 = imul_167(b0), c1 = imul_167(b1);
+    out[0] = clamp8(DESCALE(a0 + c0) + 128);
+    out[1] = clamp8(DESCALE(a1 + c1) + 128);
+    out[2] = clamp8(DESCALE(a0 - c0) + 128);
+    out[3] = clamp8(DESCALE(a1 - c1) + 128);
+}
 
-    fjctx_t ctx;
-    memset(&ctx, 0, sizeof(ctx));
-    ctx.data = data;
-    ctx.len = len;
-    ctx.scale = (uint8_t)scale;
+static const idct_ops_t idct_scalar_ops = {
+    { idct_dc, idct_2x2, idct_4x4, idct_8x8_scalar }, idct_half, idct_quarter
+};
+
+/*--- Vector IDCT ---*/
+
+/* Same Winograd flow graph as idct_rows/idct_cols, run on eight lanes at
+ * once: a transpose turns the row pass into lane-parallel work, a second
+ * transpose brings the block back for the column pass. Results match the
+ * scalar code bit for bit except where int16 intermediates would overflow. */
+
+#if FJPEG_SSE2
+
+/* (w * k + 128) >> 8 per lane, truncated to 16 bits like imul_*:
+ * bits 8..23 of the 32-bit product, plus its bit 7 for rounding */
+static inline __m128i mul8_sse2(__m128i w, int16_t k)
+{
+    __m128i kk = _mm_set1_epi16(k);
+    __m128i lo = _mm_mullo_epi16(w, kk), hi = _mm_mulhi_epi16(w, kk);
+    __m128i q = _mm_or_si128(_mm_slli_epi16(hi, 8), _mm_srli_epi16(lo, 8));
+    return _mm_add_epi16(q, _mm_and_si128(_mm_srli_epi16(lo, 7), _mm_set1_epi16(1)));
+}
+
+/* One 1D pass over eight lanes. The column pass (last = 1) forms its
+ * outputs with saturating adds: idct_cols sums them as int before
+ * clamping, and saturation clamps to the same pixel. */
+static inline void idct_1d_sse2(__m128i *v, int last)
+{
+    __m128i x4 = _mm_sub_epi16(v[5], v[3]), x7 = _mm_add_epi16(v[5], v[3]);
+    __m128i x5 = _mm_add_epi16(v[1], v[7]), x6 = _mm_sub_epi16(v[1], v[7]);
+    __m128i t1 = mul8_sse2(_mm_sub_epi16(x4, x6), 196);
+    __m128i st26 = _mm_sub_epi16(mul8_sse2(x6, 277), t1);
+    __m128i x24 = _mm_sub_epi16(t1, mul8_sse2(x4, 669));
+    __m128i x15 = _mm_sub_epi16(x5, x7), x17 = _mm_add_epi16(x5, x7);
+    __m128i t2 = _mm_sub_epi16(st26, x17);
+    __m128i t3 = _mm_sub_epi16(mul8_sse2(x15, 362), t2);
+    __m128i x44 = _mm_add_epi16(t3, x24);
+    __m128i x30 = _mm_add_epi16(v[0], v[4]), x31 = _mm_sub_epi16(v[0], v[4]);
+    __m128i x12 = _mm_sub_epi16(v[2], v[6]), x13 = _mm_add_epi16(v[2], v[6]);
+    __m128i x32 = _mm_sub_epi16(mul8_sse2(x12, 362), x13);
+    __m128i x40 = _mm_add_epi16(x30, x13), x43 = _mm_sub_epi16(x30, x13);
+    __m128i x41 = _mm_add_epi16(x31, x32), x42 = _mm_sub_epi16(x31, x32);
+    if (last) {
+        v[0] = _mm_adds_epi16(x40, x17); v[1] = _mm_adds_epi16(x41, t2);
+        v[2] = _mm_adds_epi16(x42, t3);  v[3] = _mm_subs_epi16(x43, x44);
+        v[4] = _mm_adds_epi16(x43, x44); v[5] = _mm_subs_epi16(x42, t3);
+        v[6] = _mm_subs_epi16(x41, t2);  v[7] = _mm_subs_epi16(x40, x17);
+    } else {
+        v[0] = _mm_add_epi16(x40, x17); v[1] = _mm_add_epi16(x41, t2);
+        v[2] = _mm_add_epi16(x42, t3);  v[3] = _mm_sub_epi16(x43, x44);
+        v[4] = _mm_add_epi16(x43, x44); v[5] = _mm_sub_epi16(x42, t3);
+        v[6] = _mm_sub_epi16(x41, t2);  v[7] = _mm_sub_epi16(x40, x17);
+    }
+}
+
+static inline void transpose8_sse2(__m128i *v)
+{
+    __m128i a0 = _mm_unpacklo_epi16(v[0], v[1]), a1 = _mm_unpackhi_epi16(v[0], v[1]);
+    __m128i a2 = _mm_unpacklo_epi16(v[2], v[3]), a3 = _mm_unpackhi_epi16(v[2], v[3]);
+    __m128i a4 = _mm_unpacklo_epi16(v[4], v[5]), a5 = _mm_unpackhi_epi16(v[4], v[5]);
+    __m128i a6 = _mm_unpacklo_epi16(v[6], v[7]), a7 = _mm_unpackhi_epi16(v[6], v[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+    v[0] = _mm_unpacklo_epi64(b0, b4); v[1] = _mm_unpackhi_epi64(b0, b4);
+    v[2] = _mm_unpacklo_epi64(b1, b5); v[3] = _mm_unpackhi_epi64(b1, b5);
+    v[4] = _mm_unpacklo_epi64(b2, b6); v[5] = _mm_unpackhi_epi64(b2, b6);
+    v[6] = _mm_unpacklo_epi64(b3, b7); v[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+/* clamp8(DESCALE(x) + 128); DESCALE split as (x >> 7) + bit 6 so it cannot overflow */
+static inline __m128i descale_sse2(__m128i x)
+{
+    __m128i r = _mm_and_si128(_mm_srai_epi16(x, IDCT_SCALE - 1), _mm_set1_epi16(1));
+    return _mm_add_epi16(_mm_add_epi16(_mm_srai_epi16(x, IDCT_SCALE), r), _mm_set1_epi16(128));
+}
+
+static void idct_8x8_sse2(int16_t *b, uint8_t *out)
+{
+    __m128i v[8];
+    for (int i = 0; i < 8; i++) v[i] = _mm_loadu_si128((const __m128i *)(b + i * 8));
+    transpose8_sse2(v);
+    idct_1d_sse2(v, 0);   /* rows */
+    transpose8_sse2(v);
+    idct_1d_sse2(v, 1);   /* columns */
+    for (int i = 0; i < 8; i += 2) {
+        __m128i px = _mm_packus_epi16(descale_sse2(v[i]), descale_sse2(v[i + 1]));
+        _mm_storeu_si128((__m128i *)(out + i * 8), px);
+    }
+}
+
+/* A full vector pass is already cheaper than the scalar corner kernels */
+static const idct_ops_t idct_simd_ops = {
+    { idct_dc, idct_8x8_sse2, idct_8x8_sse2, idct_8x8_sse2 }, idct_half, idct_quarter
+};
+
+#elif FJPEG_NEON
+
+/* (w * k + 128) >> 8 per lane; vrshrn rounds and narrows exactly like imul_* */
+static inline int16x8_t mul8_neon(int16x8_t w, int16_t k)
+{
+    int32x4_t lo = vmull_n_s16(vget_low_s16(w), k);
+    int32x4_t hi = vmull_n_s16(vget_high_s16(w), k);
+    return vcombine_s16(vrshrn_n_s32(lo, 8), vrshrn_n_s32(hi, 8));
+}
+
+static inline void idct_1d_neon(int16x8_t *v, int last)
+{
+    int16x8_t x4 = vsubq_s16(v[5], v[3]), x7 = vaddq_s16(v[5], v[3]);
+    int16x8_t x5 = vaddq_s16(v[1], v[7]), x6 = vsubq_s16(v[1], v[7]);
+    int16x8_t t1 = mul8_neon(vsubq_s16(x4, x6), 196);
+    int16x8_t st26 = vsubq_s16(mul8_neon(x6, 277), t1);
+    int16x8_t x24 = vsubq_s16(t1, mul8_neon(x4, 669));
+    int16x8_t x15 = vsubq_s16(x5, x7), x17 = vaddq_s16(x5, x7);
+    int16x8_t t2 = vsubq_s16(st26, x17);
+    int16x8_t t3 = vsubq_s16(mul8_neon(x15, 362), t2);
+    int16x8_t x44 = vaddq_s16(t3, x24);
+    int16x8_t x30 = vaddq_s16(v[0], v[4]), x31 = vsubq_s16(v[0], v[4]);
+    int16x8_t x12 = vsubq_s16(v[2], v[6]), x13 = vaddq_s16(v[2], v[6]);
+    int16x8_t x32 = vsubq_s16(mul8_neon(x12, 362), x13);
+    int16x8_t x40 = vaddq_s16(x30, x13), x43 = vsubq_s16(x30, x13);
+    int16x8_t x41 = vaddq_s16(x31, x32), x42 = vsubq_s16(x31, x32);
+    if (last) {
+        v[0] = vqaddq_s16(x40, x17); v[1] = vqaddq_s16(x41, t2);
+        v[2] = vqaddq_s16(x42, t3);  v[3] = vqsubq_s16(x43, x44);
+        v[4] = vqaddq_s16(x43, x44); v[5] = vqsubq_s16(x42, t3);
+        v[6] = vqsubq_s16(x41, t2);  v[7] = vqsubq_s16(x40, x17);
+    } else {
+        v[0] = vaddq_s16(x40, x17); v[1] = vaddq_s16(x41, t2);
+        v[2] = vaddq_s16(x42, t3);  v[3] = vsubq_s16(x43, x44);
+        v[4] = vaddq_s16(x43, x44); v[5] = vsubq_s16(x42, t3);
+        v[6] = vsubq_s16(x41, t2);  v[7] = vsubq_s16(x40, x17);
+    }
+}
+
+static inline void transpose8_neon(int16x8_t *v)
+{
+    int16x8x2_t t0 = vtrnq_s16(v[0], v[1]), t1 = vtrnq_s16(v[2], v[3]);
+    int16x8x2_t t2 = vtrnq_s16(v[4], v[5]), t3 = vtrnq_s16(v[6], v[7]);
+    int32x4x2_t u0 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[0]), vreinterpretq_s32_s16(t1.val[0]));
+    int32x4x2_t u1 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[1]), vreinterpretq_s32_s16(t1.val[1]));
+    int32x4x2_t u2 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[0]), vreinterpretq_s32_s16(t3.val[0]));
+    int32x4x2_t u3 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[1]), vreinterpretq_s32_s16(t3.val[1]));
+#define FJ_LO(x) vget_low_s16(vreinterpretq_s16_s32(x))
+#define FJ_HI(x) vget_high_s16(vreinterpretq_s16_s32(x))
+    v[0] = vcombine_s16(FJ_LO(u0.val[0]), FJ_LO(u2.val[0]));
+    v[1] = vcombine_s16(FJ_LO(u1.val[0]), FJ_LO(u3.val[0]));
+    v[2] = vcombine_s16(FJ_LO(u0.val[1]), FJ_LO(u2.val[1]));
+    v[3] = vcombine_s16(FJ_LO(u1.val[1]), FJ_LO(u3.val[1]));
+    v[4] = vcombine_s16(FJ_HI(u0.val[0]), FJ_HI(u2.val[0]));
+    v[5] = vcombine_s16(FJ_HI(u1.val[0]), FJ_HI(u3.val[0]));
+    v[6] = vcombine_s16(FJ_HI(u0.val[1]), FJ_HI(u2.val[1]));
+    v[7] = vcombine_s16(FJ_HI(u1.val[1]), FJ_HI(u3.val[1]));
+#undef FJ_LO
+#undef FJ_HI
+}
+
+static void idct_8x8_neon(int16_t *b, uint8_t *out)
+{
+    int16x8_t v[8];
+    for (int i = 0; i < 8; i++) v[i] = vld1q_s16(b + i * 8);
+    transpose8_neon(v);
+    idct_1d_neon(v, 0);   /* rows */
+    transpose8_neon(v);
+    idct_1d_neon(v, 1);   /* columns */
+    for (int i = 0; i < 8; i++) {
+        int16x8_t x = vaddq_s16(vrshrq_n_s16(v[i], IDCT_SCALE), vdupq_n_s16(128));
+        vst1_u8(out + i * 8, vqmovun_s16(x));
+    }
+}
+
+static const idct_ops_t idct_simd_ops = {
+    { idct_dc, idct_8x8_neon, idct_8x8_neon, idct_8x8_neon }, idct_half, idct_quarter
+};
+
+#endif
+
+/*--- Accurate IDCT ---*/
+
+/* FJPEG_ACCURATE_IDCT: libjpeg's islow transform (jidctint.c) with its
+ * 13-bit constants, 32-bit sums and two extra bits between the passes,
+ * so the output is the same as libjpeg's except where libjpeg wraps an
+ * out-of-range sample instead of clamping it. The tables then hold
+ * plain dequantized AC coefficients; the DC keeps the Winograd x16
+ * (see parse_dqt()), so DC-only blocks and 1/8 pixels need no second
+ * version. The reduced transforms are jidctred.c's, which read every
+ * coefficient below 8 but 4, or 8 but 2, 4 and 6.
+ *
+ * Damaged data can carry any 16-bit coefficient, which would overflow
+ * the 32-bit sums. The full transform is safe on 16-bit inputs, so its
+ * workspace saturates to 16 bits between the passes like the SIMD
+ * versions do; the reduced ones have larger gains and saturate their
+ * inputs and workspace to 15 bits. Real images stay well inside both. */
+
+#define ISLOW_BITS 13
+#define ISLOW_PASS1 2
+#define ISLOW_LIM(x, n) ((x) < -(1 << (n)) ? -(1 << (n)) : (x) > (1 << (n)) - 1 ? (1 << (n)) - 1 : (x))
+
+static inline uint8_t islow_px(int32_t x, int shift)
+{
+    x = (x + ((int32_t)1 << (shift - 1))) >> shift;
+    return (uint8_t)(x < -128 ? 0 : x > 127 ? 255 : x + 128);
+}
+
+/* One 1D pass on in[0], in[step], ... in[7 * step], before descaling */
+static inline void islow_1d(const int32_t *in, int step, int32_t *out)
+{
+    int32_t i0 = in[0], i1 = in[step], i2 = in[2 * step], i3 = in[3 * step];
+    int32_t i4 = in[4 * step], i5 = in[5 * step], i6 = in[6 * step], i7 = in[7 * step];
+
+    int32_t z1 = (i2 + i6) * 4433;                  /* 0.541196100 */
+    int32_t t2 = z1 - i6 * 15137, t3 = z1 + i2 * 6270;
+    int32_t t0 = (i0 + i4) * (1 << ISLOW_BITS), t1 = (i0 - i4) * (1 << ISLOW_BITS);
+    int32_t e10 = t0 + t3, e13 = t0 - t3, e11 = t1 + t2, e12 = t1 - t2;
+
+    int32_t z3 = i7 + i3, z4 = i5 + i1;
+    int32_t z5 = (z3 + z4) * 9633;                  /* 1.175875602 */
+    int32_t z1o = (i7 + i1) * -7373, z2o = (i5 + i3) * -20995;
+    z3 = z3 * -16069 + z5;
+    z4 = z4 * -3196 + z5;
+    int32_t o0 = i7 * 2446 + z1o + z3, o1 = i5 * 16819 + z2o + z4;
+    int32_t o2 = i3 * 25172 + z2o + z3, o3 = i1 * 12299 + z1o + z4;
+
+    out[0] = e10 + o3; out[7] = e10 - o3;
+    out[1] = e11 + o2; out[6] = e11 - o2;
+    out[2] = e12 + o1; out[5] = e12 - o1;
+    out[3] = e13 + o0; out[4] = e13 - o0;
+}
+
+static void idct_islow(int16_t *b, uint8_t *out)
+{
+    int32_t ws[64], v[64], r[8];
+    for (int i = 0; i < 64; i++) v[i] = b[i];
+    v[0] >>= 4;
+
+    /* Columns; all-zero AC is a common shortcut with the same result */
+    for (int i = 0; i < 8; i++) {
+        const int32_t *c = v + i;
+        if (!(c[8] | c[16] | c[24] | c[32] | c[40] | c[48] | c[56])) {
+            int32_t x = c[0] * (1 << ISLOW_PASS1);
+            for (int k = 0; k < 8; k++) ws[k * 8 + i] = ISLOW_LIM(x, 15);
+            continue;
+        }
+        islow_1d(c, 8, r);
+        for (int k = 0; k < 8; k++) {
+            int32_t x = (r[k] + (1 << (ISLOW_BITS - ISLOW_PASS1 - 1))) >> (ISLOW_BITS - ISLOW_PASS1);
+            ws[k * 8 + i] = ISLOW_LIM(x, 15);
+        }
+    }
+
+    /* Rows */
+    for (int i = 0; i < 8; i++, out += 8) {
+        const int32_t *w = ws + i * 8;
+        if (!(w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])) {
+            memset(out, islow_px(w[0], ISLOW_PASS1 + 3), 8);
+            continue;
+        }
+        islow_1d(w, 1, r);
+        for (int k = 0; k < 8; k++) out[k] = islow_px(r[k], ISLOW_BITS + ISLOW_PASS1 + 3);
+    }
+}
+
+/* Even and odd halves of jidctred.c's 4-point pass */
+#define ISLOW_4(i0, i1, i2, i3, i5, i6, i7, o) do { \
+    int32_t t0_ = (i0) * (1 << (ISLOW_BITS + 1)); \
+    int32_t t2_ = (i2) * 15137 - (i6) * 6270; \
+    int32_t e10_ = t0_ + t2_, e12_ = t0_ - t2_; \
+    int32_t a_ = -(i7) * 1730 + (i5) * 11893 - (i3) * 17799 + (i1) * 8697; \
+    int32_t b_ = -(i7) * 4176 - (i5) * 4926 + (i3) * 7373 + (i1) * 20995; \
+    (o)[0] = e10_ + b_; (o)[3] = e10_ - b_; \
+    (o)[1] = e12_ + a_; (o)[2] = e12_ - a_; \
+} while (0)
+
+/* 8x8 coefficients -> 4x4 pixels */
+static void idct_islow_half(const int16_t *b, uint8_t *out)
+{
+    int32_t ws[32], r[4], v[8];
+    int dc = b[0] >> 4;
+    for (int i = 0; i < 8; i++) {
+        if (i == 4) continue;
+        const int16_t *c = b + i;
+        int c0 = ISLOW_LIM(i ? c[0] : dc, 14);
+        if (!(c[8] | c[16] | c[24] | c[40] | c[48] | c[56])) {
+            int32_t x = c0 * (1 << ISLOW_PASS1);
+            for (int k = 0; k < 4; k++) ws[k * 8 + i] = ISLOW_LIM(x, 14);
+            continue;
+        }
+        for (int k = 1; k < 8; k++) v[k] = ISLOW_LIM(c[k * 8], 14);
+        ISLOW_4(c0, v[1], v[2], v[3], v[5], v[6], v[7], r);
+        for (int k = 0; k < 4; k++) {
+            int32_t x = (r[k] + (1 << (ISLOW_BITS - ISLOW_PASS1))) >> (ISLOW_BITS - ISLOW_PASS1 + 1);
+            ws[k * 8 + i] = ISLOW_LIM(x, 14);
+        }
+    }
+    for (int i = 0; i < 4; i++, out += 4) {
+        const int32_t *w = ws + i * 8;
+        ISLOW_4(w[0], w[1], w[2], w[3], w[5], w[6], w[7], r);
+        for (int k = 0; k < 4; k++) out[k] = islow_px(r[k], ISLOW_BITS + ISLOW_PASS1 + 4);
+    }
+}
+
+/* 8x8 coefficients -> 2x2 pixels */
+static void idct_islow_quarter(const int16_t *b, uint8_t *out)
+{
+    int32_t ws[16];
+    int dc = b[0] >> 4;
+    for (int i = 0; i < 8; i += i ? 2 : 1) {
+        const int16_t *c = b + i;
+        int32_t e = ISLOW_LIM(i ? c[0] : dc, 14) * (1 << (ISLOW_BITS + 2));
+        int32_t o = -ISLOW_LIM(c[56], 14) * 5906 + ISLOW_LIM(c[40], 14) * 6967 -
+                    ISLOW_LIM(c[24], 14) * 10426 + ISLOW_LIM(c[8], 14) * 29692;
+        int32_t x0 = (e + o + (1 << (ISLOW_BITS - ISLOW_PASS1 + 1))) >> (ISLOW_BITS - ISLOW_PASS1 + 2);
+        int32_t x1 = (e - o + (1 << (ISLOW_BITS - ISLOW_PASS1 + 1))) >> (ISLOW_BITS - ISLOW_PASS1 + 2);
+        ws[i] = ISLOW_LIM(x0, 14);
+        ws[8 + i] = ISLOW_LIM(x1, 14);
+    }
+    for (int i = 0; i < 2; i++, out += 2) {
+        const int32_t *w = ws + i * 8;
+        int32_t e = w[0] * (1 << (ISLOW_BITS + 2));
+        int32_t o = -w[7] * 5906 + w[5] * 6967 - w[3] * 10426 + w[1] * 29692;
+        out[0] = islow_px(e + o, ISLOW_BITS + ISLOW_PASS1 + 5);
+        out[1] = islow_px(e - o, ISLOW_BITS + ISLOW_PASS1 + 5);
+    }
+}
+
+static const idct_ops_t idct_islow_ops = {
+    { idct_dc, idct_islow, idct_islow, idct_islow }, idct_islow_half, idct_islow_quarter
+};
+
+#if FJPEG_SSE2
+
+/* a * k0 + b * k1 in 32 bits, for the low and the high four lanes */
+static inline void madd_sse2(__m128i a, __m128i b, int16_t k0, int16_t k1, __m128i *lo, __m128i *hi)
+{
+    __m128i k = _mm_set1_epi32((int32_t)((uint32_t)(uint16_t)k1 << 16 | (uint16_t)k0));
+    *lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k);
+    *hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k);
+}
+
+/* islow_1d on eight lanes, folded into pairs of products the way
+ * pmaddwd takes them, then descaled by shift and narrowed */
+static inline void islow_1d_sse2(__m128i *v, int shift)
+{
+    __m128i t2l, t2h, t3l, t3h, e;
+    madd_sse2(v[2], v[6], 4433 + 6270, 4433, &t3l, &t3h);
+    madd_sse2(v[2], v[6], 4433, 4433 - 15137, &t2l, &t2h);
+    e = _mm_add_epi16(v[0], v[4]);      /* << 13: high half of the lane, down 3 */
+    __m128i t0l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), e), 16 - ISLOW_BITS);
+    __m128i t0h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), e), 16 - ISLOW_BITS);
+    e = _mm_sub_epi16(v[0], v[4]);
+    __m128i t1l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), e), 16 - ISLOW_BITS);
+    __m128i t1h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), e), 16 - ISLOW_BITS);
+    __m128i ev[8] = {
+        _mm_add_epi32(t0l, t3l), _mm_add_epi32(t0h, t3h),  /* e10 */
+        _mm_add_epi32(t1l, t2l), _mm_add_epi32(t1h, t2h),  /* e11 */
+        _mm_sub_epi32(t1l, t2l), _mm_sub_epi32(t1h, t2h),  /* e12 */
+        _mm_sub_epi32(t0l, t3l), _mm_sub_epi32(t0h, t3h),  /* e13 */
+    };
+
+    __m128i z3 = _mm_add_epi16(v[7], v[3]), z4 = _mm_add_epi16(v[5], v[1]);
+    __m128i z3l, z3h, z4l, z4h, a, b;
+    madd_sse2(z3, z4, 9633 - 16069, 9633, &z3l, &z3h);
+    madd_sse2(z3, z4, 9633, 9633 - 3196, &z4l, &z4h);
+    __m128i od[8];
+    madd_sse2(v[7], v[1], 2446 - 7373, -7373, &a, &b);     /* o0 */
+    od[6] = _mm_add_epi32(a, z3l); od[7] = _mm_add_epi32(b, z3h);
+    madd_sse2(v[7], v[1], -7373, 12299 - 7373, &a, &b);    /* o3 */
+    od[0] = _mm_add_epi32(a, z4l); od[1] = _mm_add_epi32(b, z4h);
+    madd_sse2(v[5], v[3], 16819 - 20995, -20995, &a, &b);  /* o1 */
+    od[4] = _mm_add_epi32(a, z4l); od[5] = _mm_add_epi32(b, z4h);
+    madd_sse2(v[5], v[3], -20995, 25172 - 20995, &a, &b);  /* o2 */
+    od[2] = _mm_add_epi32(a, z3l); od[3] = _mm_add_epi32(b, z3h);
+
+    /* out[k] = ev[k] + od[k], out[7 - k] = ev[k] - od[k] */
+    __m128i rnd = _mm_set1_epi32(1 << (shift - 1));
+    __m128i sh = _mm_cvtsi32_si128(shift);
+    for (int k = 0; k < 4; k++) {
+        __m128i pl = _mm_sra_epi32(_mm_add_epi32(_mm_add_epi32(ev[2 * k], od[2 * k]), rnd), sh);
+        __m128i ph = _mm_sra_epi32(_mm_add_epi32(_mm_add_epi32(ev[2 * k + 1], od[2 * k + 1]), rnd), sh);
+        __m128i ml = _mm_sra_epi32(_mm_add_epi32(_mm_sub_epi32(ev[2 * k], od[2 * k]), rnd), sh);
+        __m128i mh = _mm_sra_epi32(_mm_add_epi32(_mm_sub_epi32(ev[2 * k + 1], od[2 * k + 1]), rnd), sh);
+        v[k] = _mm_packs_epi32(pl, ph);
+        v[7 - k] = _mm_packs_epi32(ml, mh);
+    }
+}
+
+static void idct_islow_sse2(int16_t *b, uint8_t *out)
+{
+    __m128i v[8];
+    b[0] = (int16_t)(b[0] >> 4);
+    for (int i = 0; i < 8; i++) v[i] = _mm_loadu_si128((const __m128i *)(b + i * 8));
+    islow_1d_sse2(v, ISLOW_BITS - ISLOW_PASS1);        /* columns */
+    transpose8_sse2(v);
+    islow_1d_sse2(v, ISLOW_BITS + ISLOW_PASS1 + 3);    /* rows */
+    transpose8_sse2(v);
+    for (int i = 0; i < 8; i += 2) {
+        __m128i px = _mm_packus_epi16(_mm_adds_epi16(v[i], _mm_set1_epi16(128)),
+                                      _mm_adds_epi16(v[i + 1], _mm_set1_epi16(128)));
+        _mm_storeu_si128((__m128i *)(out + i * 8), px);
+    }
+}
+
+static const idct_ops_t idct_islow_simd_ops = {
+    { idct_dc, idct_islow_sse2, idct_islow_sse2, idct_islow_sse2 }, idct_islow_half, idct_islow_quarter
+};
+
+#elif FJPEG_NEON
+
+/* islow_1d on four lanes */
+static inline void islow_1d_neon(const int16x4_t *v, int32x4_t *out)
+{
+    int32x4_t z1 = vmull_n_s16(vadd_s16(v[2], v[6]), 4433);
+    int32x4_t t2 = vmlal_n_s16(z1, v[6], -15137), t3 = vmlal_n_s16(z1, v[2], 6270);
+    int32x4_t t0 = vshll_n_s16(vadd_s16(v[0], v[4]), ISLOW_BITS);
+    int32x4_t t1 = vshll_n_s16(vsub_s16(v[0], v[4]), ISLOW_BITS);
+    int32x4_t e10 = vaddq_s32(t0, t3), e13 = vsubq_s32(t0, t3);
+    int32x4_t e11 = vaddq_s32(t1, t2), e12 = vsubq_s32(t1, t2);
+
+    int16x4_t z3 = vadd_s16(v[7], v[3]), z4 = vadd_s16(v[5], v[1]);
+    int32x4_t z5 = vmull_n_s16(vadd_s16(z3, z4), 9633);
+    int32x4_t z1o = vmull_n_s16(vadd_s16(v[7], v[1]), -7373);
+    int32x4_t z2o = vmull_n_s16(vadd_s16(v[5], v[3]), -20995);
+    int32x4_t z3s = vmlal_n_s16(z5, z3, -16069), z4s = vmlal_n_s16(z5, z4, -3196);
+    int32x4_t o0 = vaddq_s32(vmlal_n_s16(z1o, v[7], 2446), z3s);
+    int32x4_t o1 = vaddq_s32(vmlal_n_s16(z2o, v[5], 16819), z4s);
+    int32x4_t o2 = vaddq_s32(vmlal_n_s16(z2o, v[3], 25172), z3s);
+    int32x4_t o3 = vaddq_s32(vmlal_n_s16(z1o, v[1], 12299), z4s);
+
+    out[0] = vaddq_s32(e10, o3); out[7] = vsubq_s32(e10, o3);
+    out[1] = vaddq_s32(e11, o2); out[6] = vsubq_s32(e11, o2);
+    out[2] = vaddq_s32(e12, o1); out[5] = vsubq_s32(e12, o1);
+    out[3] = vaddq_s32(e13, o0); out[4] = vsubq_s32(e13, o0);
+}
+
+/* Both halves of eight lanes; the row pass descales by more than
+ * vrshrn takes, so it rounds at 32 bits and narrows with saturation */
+static inline void islow_pass_neon(int16x8_t *v, int rows)
+{
+    int16x4_t lo[8], hi[8];
+    int32x4_t rl[8], rh[8];
+    for (int k = 0; k < 8; k++) {
+        lo[k] = vget_low_s16(v[k]);
+        hi[k] = vget_high_s16(v[k]);
+    }
+    islow_1d_neon(lo, rl);
+    islow_1d_neon(hi, rh);
+    for (int k = 0; k < 8; k++) {
+        if (rows)
+            v[k] = vcombine_s16(vqmovn_s32(vrshrq_n_s32(rl[k], ISLOW_BITS + ISLOW_PASS1 + 3)),
+                                vqmovn_s32(vrshrq_n_s32(rh[k], ISLOW_BITS + ISLOW_PASS1 + 3)));
+        else
+            v[k] = vcombine_s16(vrshrn_n_s32(rl[k], ISLOW_BITS - ISLOW_PASS1),
+                                vrshrn_n_s32(rh[k], ISLOW_BITS - ISLOW_PASS1));
+    }
+}
+
+static void idct_islow_neon(int16_t *b, uint8_t *out)
+{
+    int16x8_t v[8];
+    b[0] = (int16_t)(b[0] >> 4);
+    for (int i = 0; i < 8; i++) v[i] = vld1q_s16(b + i * 8);
+    islow_pass_neon(v, 0);   /* columns */
+    transpose8_neon(v);
+    islow_pass_neon(v, 1);   /* rows */
+    transpose8_neon(v);
+    for (int i = 0; i < 8; i++)
+        vst1_u8(out + i * 8, vqmovun_s16(vqaddq_s16(v[i], vdupq_n_s16(128))));
+}
+
+static const idct_ops_t idct_islow_simd_ops = {
+    { idct_dc, idct_islow_neon, idct_islow_neon, idct_islow_neon }, idct_islow_half, idct_islow_quarter
+};
+
+#endif
+
+static const idct_ops_t *idct_select(int accurate)
+{
+#if FJPEG_SSE2 || FJPEG_NEON
+    (void)idct_scalar_ops;  /* reference kernels stay built */
+    (void)idct_islow_ops;
+    return accurate ? &idct_islow_simd_ops : &idct_simd_ops;
+#else
+    return accurate ? &idct_islow_ops : &idct_scalar_ops;
+#endif
+}
+
+/*--- Block decoding ---*/
+
+/* Entropy-decode and dequantize one block into blk, which is all zero
+ * on entry (c->block, or a pipeline slot). Returns the highest zigzag
+ * index written, or -1 if a run overshoots the block. */
+static int decode_coefs(fjctx_t *c, int comp, int16_t *blk)
+{
+    int last = 0;             /* highest zigzag index written */
+    STAT_ADD(c, blocks, 1);
+
+    int qtab = c->comp_qtab[comp];
+    const int16_t *q = c->qtab[qtab];
+
+    /* DC coefficient */
+    int dc_tab = c->comp_dc[comp];
+    uint8_t s = huff_decode(c, dc_tab);
+    uint8_t nbits = s & 0x0F;
+    int16_t dc = huff_extend(get_bits(c, nbits), nbits);
+    dc += c->last_dc[comp];
+    c->last_dc[comp] = dc;
+    blk[0] = dc * q[0];
+
+    /* AC coefficients */
+    int ac_tab = c->comp_ac[comp] + 2;
+#if FJPEG_HUFF_LOOKAHEAD
+    const int16_t *fast = c->fast_ac[c->comp_ac[comp]];
+#endif
+    for (int k = 1; k < 64; k++) {
+#if FJPEG_HUFF_LOOKAHEAD
+        fill_bits(c);
+        int16_t f = fast[c->bits >> (FJPEG_BITBUF_BITS - FJPEG_HUFF_LOOKAHEAD)];
+        if (f) {
+            k += (f >> 4) & 0x0F;
+            if (k >= 64) return -1;
+            c->bits <<= f & 0x0F;
+            c->nbits -= f & 0x0F;
+            blk[zag[k]] = (int16_t)((f >> 8) * q[k]);
+            last = k;
+            continue;
+        }
+#endif
+        s = huff_decode(c, ac_tab);
+        uint8_t run = s >> 4;
+        uint8_t size = s & 0x0F;
+        if (size == 0) {
+            if (run == 15) { k += 15; continue; } /* ZRL: skip 16 zeros */
+            break; /* EOB */
+        }
+        k += run;
+        if (k >= 64) return -1;
+        int16_t ac = huff_extend(get_bits(c, size), size);
+        blk[zag[k]] = ac * q[k];
+        last = k;
+    }
+
+    return last;
+}
+
+/* Rows of c->block an IDCT may leave nonzero, per sparsity class */
+static const uint8_t dirty_rows[IDCT_CLASSES] = { 1, 2, 4, 8 };
+
+/*--- DC-only block decode (1/8 scale) ---*/
+
+/* Consume the AC coefficients of a block without decoding their values.
+ * With lookahead, a short code and its magnitude bits go in one shift,
+ * on a local copy of the bit buffer. */
+static int skip_ac(fjctx_t *c, int comp)
+{
+    int ac_tab = c->comp_ac[comp] + 2;
+#if FJPEG_HUFF_LOOKAHEAD
+    const uint16_t *look = c->huff[ac_tab].look;
+    bitbuf_t bits = c->bits;
+    int nbits = c->nbits, ret = 0;
+    for (int k = 1; k < 64; k++) {
+        if (nbits <= BITBUF_LOW) {
+            c->bits = bits; c->nbits = nbits;
+            refill_bits(c);
+            bits = c->bits; nbits = c->nbits;
+        }
+        uint16_t e = look[bits >> (FJPEG_BITBUF_BITS - FJPEG_HUFF_LOOKAHEAD)];
+        uint8_t s = (uint8_t)e;
+        int size = s & 0x0F;
+        if (!e) {
+            c->bits = bits; c->nbits = nbits;
+            s = huff_decode(c, ac_tab);
+            size = s & 0x0F;
+            get_bits(c, size);
+            bits = c->bits; nbits = c->nbits;
+        } else if ((e >> 8) + size <= nbits) {
+            bits <<= (e >> 8) + size;
+            nbits -= (e >> 8) + size;
+        } else {
+            /* 32-bit buffer: a 9-12 bit code plus 15 may not fit */
+            bits <<= e >> 8;
+            nbits -= e >> 8;
+            c->bits = bits; c->nbits = nbits;
+            get_bits(c, size);
+            bits = c->bits; nbits = c->nbits;
+        }
+        if (size == 0) {
+            if ((s >> 4) == 15) { k += 15; continue; }
+            break; /* EOB */
+        }
+        k += s >> 4;
+        if (k >= 64) { ret = -1; break; }
+    }
+    c->bits = bits;
+    c->nbits = nbits;
+    return ret;
+#else
+    for (int k = 1; k < 64; k++) {
+        uint8_t s = huff_decode(c, ac_tab);
+        uint8_t run = s >> 4;
+        uint8_t size = s & 0x0F;
+        if (size == 0) {
+            if (run == 15) { k += 15; continue; }
+            break; /* EOB */
+        }
+        k += run;
+        if (k >= 64) return -1;
+        get_bits(c, size);
+    }
+    return 0;
+#endif
+}
+
+static int decode_block_dc_only(fjctx_t *c, int comp, uint8_t *pixel_out)
+{
+    STAT_ADD(c, blocks, 1);
+    int qtab = c->comp_qtab[comp];
+    const int16_t *q = c->qtab[qtab];
+
+    /* DC coefficient */
+    int dc_tab = c->comp_dc[comp];
+    uint8_t s = huff_decode(c, dc_tab);
+    uint8_t nbits = s & 0x0F;
+    int16_t dc = huff_extend(get_bits(c, nbits), nbits);
+    dc += c->last_dc[comp];
+    c->last_dc[comp] = dc;
+
+    /* The DC value after dequantization is the block average.
+     * q[0] is pre-scaled for Winograd, so we need to undo that scaling:
+     * raw_dequant = dc * original_qtab[0]
+     * But our qtab is pre-multiplied: qtab[0] = original * wquant[0] / 8
+     * wquant[0] = 128, so qtab[0] = original * 16
+     * After IDCT, each sample = DESCALE(dc * qtab[0]) + 128
+     * For DC-only, all 64 samples would be the same, so this is correct. */
+    *pixel_out = clamp8(DESCALE(dc * q[0]) + 128);
+
+    return skip_ac(c, comp);
+}
+
+/*--- Restart processing ---*/
+
+/* Scan for the next RSTn and start the interval after it. The last
+ * interval ends right at the marker, fill bytes aside; data left over
+ * means it lost sync, and a marker other than the expected one means
+ * intervals were lost. Either is corrupt data. Under FJPEG_CONCEAL a
+ * leftover only marks the image damaged, as the interval is out
+ * already, and an unexpected marker is left for the interval it
+ * belongs to while this one is concealed. */
+static void process_restart(fjctx_t *c)
+{
+    int m = -1, left = 0;
+    c->nbits = 0;
+    c->bits = 0;
+    c->zfill = 0;
+    c->corrupt = 0;
+    while (avail(c, 2)) {
+        if (c->data[c->pos] == 0xFF && c->data[c->pos + 1] >= 0xD0 &&
+            c->data[c->pos + 1] <= 0xD7) {
+            m = c->data[c->pos + 1] & 7;
+            c->pos += 2;
+            break;
+        }
+        left |= c->data[c->pos] != 0xFF;
+        c->pos++;
+    }
+    if (c->resync) left = 0;
+    c->resync = 0;
+    if (m >= 0 && m != c->next_restart) {
+        if (c->conceal) {
+            c->pos -= 2;
+            c->lost = c->restart_interval;
+        }
+        left = 1;
+    }
+    if (left) {
+        if (c->conceal) c->damaged = 1;
+        else c->corrupt = 1;
+    }
+    c->last_dc[0] = c->last_dc[1] = c->last_dc[2] = 0;
+    c->eobrun = 0;
+    c->restarts_left = c->restart_interval;
+    c->next_restart = (c->next_restart + 1) & 7;
+    STAT_ADD(c, restarts, 1);
+}
+
+/*--- Decoder state save/restore (for two-pass H2V2) ---*/
+
+static void save_state(const fjctx_t *c, decode_save_t *s)
+{
+    s->pos = c->pos;
+    s->bits = c->bits;
+    s->nbits = c->nbits;
+    s->zfill = c->zfill;
+    s->corrupt = c->corrupt;
+    s->resync = c->resync;
+    s->lost = c->lost;
+    s->last_dc[0] = c->last_dc[0];
+    s->last_dc[1] = c->last_dc[1];
+    s->last_dc[2] = c->last_dc[2];
+    s->restarts_left = c->restarts_left;
+    s->next_restart = c->next_restart;
+}
+
+static void restore_state(fjctx_t *c, const decode_save_t *s)
+{
+    c->pos = s->pos;
+    c->bits = s->bits;
+    c->nbits = s->nbits;
+    c->zfill = s->zfill;
+    c->corrupt = s->corrupt;
+    c->resync = s->resync;
+    c->lost = s->lost;
+    c->last_dc[0] = s->last_dc[0];
+    c->last_dc[1] = s->last_dc[1];
+    c->last_dc[2] = s->last_dc[2];
+    c->restarts_left = s->restarts_left;
+    c->next_restart = s->next_restart;
+}
+
+/*--- Color conversion ---*/
+
+/* Rec.601 full-range YCbCr to RGB in 8-bit fixed point. Row converters are
+ * plain loops over arrays with no calls or branches, so compilers
+ * vectorize them (SSE2/NEON min/max for the clamps). */
+static inline int clamp255(int x)
+{
+    return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+#define YCC_RGB(i) \
+    int cr_ = (int)cr[i] - 128, cb_ = (int)cb[i] - 128; \
+    int r = clamp255(y[i] + ((cr_ * 359) >> 8)); \
+    int g = clamp255(y[i] - ((cb_ * 88 + cr_ * 183) >> 8)); \
+    int b = clamp255(y[i] + ((cb_ * 454) >> 8))
+
+#define RGB565(r, g, b) (((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3))
+
+static void row_rgb565(const uint8_t *restrict y, const uint8_t *restrict cb,
+                       const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    uint16_t *o = (uint16_t *)out;
+    for (int i = 0; i < w; i++) {
+        YCC_RGB(i);
+        o[i] = (uint16_t)RGB565(r, g, b);
+    }
+}
+
+static void row_rgb565_be(const uint8_t *restrict y, const uint8_t *restrict cb,
+                          const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    for (int i = 0; i < w; i++) {
+        YCC_RGB(i);
+        int v = RGB565(r, g, b);
+        out[2 * i] = (uint8_t)(v >> 8);
+        out[2 * i + 1] = (uint8_t)v;
+    }
+}
+
+#if !FJPEG_VEC_RGB565  /* else the native-order vector kernel is LE */
+static void row_rgb565_le(const uint8_t *restrict y, const uint8_t *restrict cb,
+                          const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    for (int i = 0; i < w; i++) {
+        YCC_RGB(i);
+        int v = RGB565(r, g, b);
+        out[2 * i] = (uint8_t)v;
+        out[2 * i + 1] = (uint8_t)(v >> 8);
+    }
+}
+#endif
+
+static void row_rgb888(const uint8_t *restrict y, const uint8_t *restrict cb,
+                       const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    for (int i = 0; i < w; i++) {
+        YCC_RGB(i);
+        out[3 * i] = (uint8_t)r;
+        out[3 * i + 1] = (uint8_t)g;
+        out[3 * i + 2] = (uint8_t)b;
+    }
+}
+
+static void row_rgba8888(const uint8_t *restrict y, const uint8_t *restrict cb,
+                         const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    for (int i = 0; i < w; i++) {
+        YCC_RGB(i);
+        out[4 * i] = (uint8_t)r;
+        out[4 * i + 1] = (uint8_t)g;
+        out[4 * i + 2] = (uint8_t)b;
+        out[4 * i + 3] = 255;
+    }
+}
+
+static void row_y8(const uint8_t *restrict y, const uint8_t *restrict cb,
+                   const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    (void)cb; (void)cr;
+    memcpy(out, y, w);
+}
+
+static void row_ycbcr(const uint8_t *restrict y, const uint8_t *restrict cb,
+                      const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    memcpy(out, y, w);
+    memcpy(out + w, cb, w);
+    memcpy(out + 2 * w, cr, w);
+}
+
+/* Vector RGB565, 8 pixels per step, bit-exact with YCC_RGB. R and B split
+ * their multipliers (359 = 256 + 103, 454 = 512 - 58) so the products fit
+ * a 16-bit high multiply; G needs the 32-bit sum before the shift. */
+#if FJPEG_SSE2
+
+static inline __m128i rgb565_sse2(const uint8_t *y, const uint8_t *cb, const uint8_t *cr)
+{
+    const __m128i z = _mm_setzero_si128(), k128 = _mm_set1_epi16(128);
+    __m128i Y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)y), z);
+    __m128i B = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)cb), z), k128);
+    __m128i R = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)cr), z), k128);
+
+    __m128i r = _mm_add_epi16(Y, _mm_add_epi16(R, _mm_mulhi_epi16(R, _mm_set1_epi16(103 << 8))));
+    __m128i b = _mm_add_epi16(Y, _mm_add_epi16(_mm_add_epi16(B, B),
+                                               _mm_mulhi_epi16(B, _mm_set1_epi16(-58 * 256))));
+    const __m128i kg = _mm_set1_epi32((183 << 16) | 88);  /* (cb, cr) pairs */
+    __m128i glo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(B, R), kg), 8);
+    __m128i ghi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(B, R), kg), 8);
+    __m128i g = _mm_sub_epi16(Y, _mm_packs_epi32(glo, ghi));
+
+    /* Clamp to 0..255 by unsigned saturation, then pack */
+    r = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), z);
+    g = _mm_unpacklo_epi8(_mm_packus_epi16(g, g), z);
+    b = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), z);
+    r = _mm_slli_epi16(_mm_and_si128(r, _mm_set1_epi16(0xF8)), 8);
+    g = _mm_slli_epi16(_mm_and_si128(g, _mm_set1_epi16(0xFC)), 3);
+    return _mm_or_si128(_mm_or_si128(r, g), _mm_srli_epi16(b, 3));
+}
+
+static void row_rgb565_vec(const uint8_t *restrict y, const uint8_t *restrict cb,
+                           const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    int i = 0;
+    for (; i + 8 <= w; i += 8)
+        _mm_storeu_si128((__m128i *)(out + 2 * i), rgb565_sse2(y + i, cb + i, cr + i));
+    row_rgb565(y + i, cb + i, cr + i, out + 2 * i, w - i);
+}
+
+static void row_rgb565_be_vec(const uint8_t *restrict y, const uint8_t *restrict cb,
+                              const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    int i = 0;
+    for (; i + 8 <= w; i += 8) {
+        __m128i v = rgb565_sse2(y + i, cb + i, cr + i);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), v);
+    }
+    row_rgb565_be(y + i, cb + i, cr + i, out + 2 * i, w - i);
+}
+
+#elif FJPEG_NEON && !defined(__ARM_BIG_ENDIAN)
+
+static inline int16x8_t shrn8_neon(int32x4_t lo, int32x4_t hi)
+{
+    return vcombine_s16(vshrn_n_s32(lo, 8), vshrn_n_s32(hi, 8));
+}
+
+static inline uint16x8_t rgb565_neon(const uint8_t *y, const uint8_t *cb, const uint8_t *cr)
+{
+    const int16x8_t k128 = vdupq_n_s16(128);
+    int16x8_t Y = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y)));
+    int16x8_t B = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(cb))), k128);
+    int16x8_t R = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(cr))), k128);
+    int16x4_t bl = vget_low_s16(B), bh = vget_high_s16(B);
+    int16x4_t rl = vget_low_s16(R), rh = vget_high_s16(R);
+
+    int16x8_t r = vaddq_s16(Y, shrn8_neon(vmull_n_s16(rl, 359), vmull_n_s16(rh, 359)));
+    int16x8_t g = vsubq_s16(Y, shrn8_neon(vmlal_n_s16(vmull_n_s16(bl, 88), rl, 183),
+                                          vmlal_n_s16(vmull_n_s16(bh, 88), rh, 183)));
+    int16x8_t b = vaddq_s16(Y, shrn8_neon(vmull_n_s16(bl, 454), vmull_n_s16(bh, 454)));
+
+    uint16x8_t r8 = vmovl_u8(vqmovun_s16(r));
+    uint16x8_t g8 = vmovl_u8(vqmovun_s16(g));
+    uint16x8_t b8 = vmovl_u8(vqmovun_s16(b));
+    return vorrq_u16(vorrq_u16(vshlq_n_u16(vandq_u16(r8, vdupq_n_u16(0xF8)), 8),
+                               vshlq_n_u16(vandq_u16(g8, vdupq_n_u16(0xFC)), 3)),
+                     vshrq_n_u16(b8, 3));
+}
+
+static void row_rgb565_vec(const uint8_t *restrict y, const uint8_t *restrict cb,
+                           const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    int i = 0;
+    for (; i + 8 <= w; i += 8)
+        vst1q_u8(out + 2 * i, vreinterpretq_u8_u16(rgb565_neon(y + i, cb + i, cr + i)));
+    row_rgb565(y + i, cb + i, cr + i, out + 2 * i, w - i);
+}
+
+static void row_rgb565_be_vec(const uint8_t *restrict y, const uint8_t *restrict cb,
+                              const uint8_t *restrict cr, uint8_t *restrict out, int w)
+{
+    int i = 0;
+    for (; i + 8 <= w; i += 8)
+        vst1q_u8(out + 2 * i, vrev16q_u8(vreinterpretq_u8_u16(rgb565_neon(y + i, cb + i, cr + i))));
+    row_rgb565_be(y + i, cb + i, cr + i, out + 2 * i, w - i);
+}
+
+#endif
+
+/* Indexed by FJPEG_FMT_* */
+static const struct {
+    convert_fn fn;
+    uint8_t bpp;
+} formats[] = {
+#if FJPEG_VEC_RGB565
+    { row_rgb565_vec, 2 }, { row_rgb565_be_vec, 2 }, { row_rgb565_vec, 2 },
+#else
+    { row_rgb565, 2 }, { row_rgb565_be, 2 }, { row_rgb565_le, 2 },
+#endif
+    { row_rgb888, 3 }, { row_rgba8888, 4 }, { row_y8, 1 }, { row_ycbcr, 3 },
+};
+
+#define NUM_FORMATS (int)(sizeof(formats) / sizeof(formats[0]))
+
+/* Hand one output row to whichever callback the caller set */
+static void put_row(const fjpeg_opts_t *opts, fjpeg_row_cb cb, void *user,
+                    int y, int w, const uint8_t *px)
+{
+    if (opts->pixel_cb)
+        opts->pixel_cb(y, w, px, user);
+    else
+        cb(y, w, (const uint16_t *)px, user);
+}
+
+/* Next buffer in rotation r. A buffer handed out before waits until the
+ * caller is done with it. */
+static uint8_t *rot_next(fjctx_t *c, fjrot_t *r, const fjpeg_opts_t *opts, void *user)
+{
+    uint8_t *p = r->buf + (size_t)r->i * r->size;
+    (void)c;
+    if (r->wrapped && opts->out_wait) {
+        STAGE(c, STAGE_OUTPUT);
+        opts->out_wait(p, user);
+    }
+    if (++r->i == r->n) {
+        r->i = 0;
+        r->wrapped = 1;
+    }
+    return p;
+}
+
+/* Wait for every buffer of rotation r still handed out, oldest first,
+ * before the scratch that holds it is freed */
+static void rot_drain(fjctx_t *c, fjrot_t *r, const fjpeg_opts_t *opts, void *user)
+{
+    int n = r->wrapped ? r->n : r->i;
+    (void)c;
+    if (!opts->out_wait || !n) return;
+    STAGE(c, STAGE_OUTPUT);
+    for (int k = 0; k < n; k++) {
+        int b = r->wrapped ? (r->i + k) % r->n : k;
+        opts->out_wait(r->buf + (size_t)b * r->size, user);
+    }
+    r->i = 0;
+    r->wrapped = 0;
+}
+
+/* Buffers in the output rotation */
+static int out_count(const fjpeg_opts_t *opts)
+{
+    return opts->out_bufs > 1 ? opts->out_bufs : 1;
+}
+
+/* Next output row or tile buffer */
+static uint8_t *next_out(fjctx_t *c, const fjpeg_opts_t *opts, void *user)
+{
+    return rot_next(c, &c->out, opts, user);
+}
+
+/*--- Chroma upsampling ---*/
+
+/* Each upsampler expands n chroma samples of row near into out. far is
+ * the vertically adjacent chroma row (the one above for the upper output
+ * row of a pair, below for the lower), equal to near at the image edges.
+ * The fancy filters are libjpeg's triangle filters: 3/4 near, 1/4 far in
+ * each direction, with the same rounding, so output matches djpeg. */
+
+/* H2: each chroma sample covers two pixels */
+static void up_h2(const uint8_t *restrict near, const uint8_t *restrict far,
+                  uint8_t *restrict out, int n)
+{
+    (void)far;
+    for (int i = 0; i < n; i++)
+        out[2 * i] = out[2 * i + 1] = near[i];
+}
+
+/* H2V1 fancy: filter along the row only */
+static void up_h2_fancy(const uint8_t *restrict near, const uint8_t *restrict far,
+                        uint8_t *restrict out, int n)
+{
+    (void)far;
+    if (n == 1) {
+        out[0] = out[1] = near[0];
+        return;
+    }
+    out[0] = near[0];
+    out[1] = (uint8_t)((3 * near[0] + near[1] + 2) >> 2);
+    for (int i = 1; i < n - 1; i++) {
+        int v = 3 * near[i];
+        out[2 * i] = (uint8_t)((v + near[i - 1] + 1) >> 2);
+        out[2 * i + 1] = (uint8_t)((v + near[i + 1] + 2) >> 2);
+    }
+    out[2 * n - 2] = (uint8_t)((3 * near[n - 1] + near[n - 2] + 1) >> 2);
+    out[2 * n - 1] = near[n - 1];
+}
+
+/* H2V2 fancy: column sums 3*near + far, then filtered along the row */
+static void up_h2v2_fancy(const uint8_t *restrict near, const uint8_t *restrict far,
+                          uint8_t *restrict out, int n)
+{
+#define COLSUM(i) (3 * near[i] + far[i])
+    if (n == 1) {
+        out[0] = (uint8_t)((4 * COLSUM(0) + 8) >> 4);
+        out[1] = (uint8_t)((4 * COLSUM(0) + 7) >> 4);
+        return;
+    }
+    out[0] = (uint8_t)((4 * COLSUM(0) + 8) >> 4);
+    out[1] = (uint8_t)((3 * COLSUM(0) + COLSUM(1) + 7) >> 4);
+    for (int i = 1; i < n - 1; i++) {
+        int v = 3 * COLSUM(i);
+        out[2 * i] = (uint8_t)((v + COLSUM(i - 1) + 8) >> 4);
+        out[2 * i + 1] = (uint8_t)((v + COLSUM(i + 1) + 7) >> 4);
+    }
+    out[2 * n - 2] = (uint8_t)((3 * COLSUM(n - 1) + COLSUM(n - 2) + 8) >> 4);
+    out[2 * n - 1] = (uint8_t)((4 * COLSUM(n - 1) + 7) >> 4);
+#undef COLSUM
+}
+
+/* H1V2 fancy: filter down the column only */
+static void up_v2_fancy(const uint8_t *restrict near, const uint8_t *restrict far,
+                        uint8_t *restrict out, int n)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = (uint8_t)((3 * near[i] + far[i] + 2) >> 2);
+}
+
+/* Pick the upsampler for the image sampling; NULL means the chroma plane
+ * rows can go straight to the converter */
+static void select_upsample(fjctx_t *c)
+{
+    int fancy_v = c->fancy && c->v_shift;
+    int n = c->h_shift ? (c->out_w + 1) >> 1 : c->out_w;   /* chroma columns */
+    c->upsample = NULL;
+    if (!c->need_chroma) return;
+    if (c->h_shift)
+        c->upsample = fancy_v ? up_h2v2_fancy : c->fancy ? up_h2_fancy : up_h2;
+    else if (fancy_v)
+        c->upsample = up_v2_fancy;
+
+    /* The planes start at MCU column mx0; stop at the image edge */
+    n -= c->mx0 * c->bs;
+    c->up_n = (uint16_t)(n < (int)c->cstride ? n : (int)c->cstride);
+}
+
+/* Upsample and convert one output row. cb/cr are the nearest chroma
+ * rows, cb1/cr1 their vertical neighbours for fancy upsampling. */
+static void convert_row(const fjctx_t *c, const uint8_t *y,
+                        const uint8_t *cb, const uint8_t *cb1,
+                        const uint8_t *cr, const uint8_t *cr1, uint8_t *out)
+{
+    if (c->upsample) {
+        c->upsample(cb, cb1, c->cbup, c->up_n);
+        c->upsample(cr, cr1, c->crup, c->up_n);
+        cb = c->cbup;
+        cr = c->crup;
+    }
+    c->convert(y + c->ox, cb + c->ox, cr + c->ox, out, c->roi_w);
+}
+
+/* Convert Y plane row r, which is row py of its MCU row. With vertical
+ * fancy upsampling the last row of the MCU row needs the next MCU row's
+ * chroma, so the caller converts it later from the context rows. */
+static void convert_plane_row(const fjctx_t *c, int r, int py, uint8_t *out)
+{
+    int cy = py >> c->v_shift, cy1 = cy;
+    if (c->fancy && c->v_shift) cy1 = py & 1 ? cy + 1 : cy - 1;
+    ptrdiff_t cs = c->cstride;
+    convert_row(c, c->ybuf + (size_t)r * c->ystride,
+                c->cbbuf + cy * cs, c->cbbuf + cy1 * cs,
+                c->crbuf + cy * cs, c->crbuf + cy1 * cs, out);
+}
+
+/* Convert the first n rows of the planes into out, stride roi_w * bpp */
+static void convert_rows(const fjctx_t *c, int n, uint8_t *out)
+{
+    size_t stride = (size_t)c->roi_w * c->bpp;
+    for (int r = 0; r < n; r++)
+        convert_plane_row(c, r, r, out + r * stride);
+}
+
+/*--- Resampling ---*/
+
+/* Output at a target size (fjpeg_opts_t.target_w/h): the image is
+ * decoded at the smallest scale that still covers the target, in an
+ * 8-bit format, and each source row goes to resize_row(). That resamples
+ * it across into hv[0], in 1/16 steps, then down, and hands each output
+ * row on in the caller's format as soon as it is complete. The box
+ * filter adds every source row into acc, weighted by how much of the
+ * output row it covers; bilinear blends the last two source rows. */
+
+/* RGB888 row to another format */
+typedef void (*pack_fn)(const uint8_t *restrict rgb, uint8_t *restrict out, int w);
+
+typedef struct {
+    fjctx_t *c;
+    const fjpeg_opts_t *opts;   /* the caller's: callbacks and out_wait */
+    fjpeg_row_cb cb;
+    void *user;
+    fjrot_t out;                /* output rows of tw pixels */
+    pack_fn pack;               /* NULL when rows are resampled as they go out */
+    uint8_t *mid;               /* the output row before pack */
+    uint16_t *hv[2];            /* source rows resampled across, x16: the
+                                 * latest and (bilinear) the one before */
+    uint32_t *acc;              /* box: the output row so far, x65536 */
+    uint32_t *xtab;             /* bilinear: bilinear_pos() per column */
+    int sw, sh, tw, th;
+    uint8_t ch, planes;         /* samples per pixel, planes per row */
+    uint8_t bilinear;
+    int y;                      /* next output row */
+} fjresize_t;
+
+static void pack_rgb565(const uint8_t *restrict rgb, uint8_t *restrict out, int w)
+{
+    uint16_t *o = (uint16_t *)out;
+    for (int i = 0; i < w; i++, rgb += 3)
+        o[i] = (uint16_t)RGB565(rgb[0], rgb[1], rgb[2]);
+}
+
+static void pack_rgb565_be(const uint8_t *restrict rgb, uint8_t *restrict out, int w)
+{
+    for (int i = 0; i < w; i++, rgb += 3) {
+        int v = RGB565(rgb[0], rgb[1], rgb[2]);
+        out[2 * i] = (uint8_t)(v >> 8);
+        out[2 * i + 1] = (uint8_t)v;
+    }
+}
+
+static void pack_rgb565_le(const uint8_t *restrict rgb, uint8_t *restrict out, int w)
+{
+    for (int i = 0; i < w; i++, rgb += 3) {
+        int v = RGB565(rgb[0], rgb[1], rgb[2]);
+        out[2 * i] = (uint8_t)v;
+        out[2 * i + 1] = (uint8_t)(v >> 8);
+    }
+}
+
+static void pack_rgba8888(const uint8_t *restrict rgb, uint8_t *restrict out, int w)
+{
+    for (int i = 0; i < w; i++, rgb += 3, out += 4) {
+        out[0] = rgb[0];
+        out[1] = rgb[1];
+        out[2] = rgb[2];
+        out[3] = 255;
+    }
+}
+
+/* Indexed by FJPEG_FMT_*: the format rows are resampled in, and the
+ * step from there to the caller's */
+static const struct {
+    uint8_t format;
+    pack_fn pack;
+} wide_formats[] = {
+    { FJPEG_FMT_RGB888, pack_rgb565 }, { FJPEG_FMT_RGB888, pack_rgb565_be },
+    { FJPEG_FMT_RGB888, pack_rgb565_le }, { FJPEG_FMT_RGB888, NULL },
+    { FJPEG_FMT_RGB888, pack_rgba8888 }, { FJPEG_FMT_Y8, NULL },
+    { FJPEG_FMT_YCBCR, NULL },
+};
+
+/* Where the centre of output pixel x of t falls among s source pixels,
+ * clamped to the edge ones: the pixel to its left << 8 | the weight of
+ * the one to its right, in 1/256 */
+static uint32_t bilinear_pos(int x, int s, int t)
+{
+    int64_t p = ((int64_t)(2 * x + 1) * s * 128) / t - 128;
+    if (p < 0) p = 0;
+    if (p > (int64_t)(s - 1) * 256) p = (int64_t)(s - 1) * 256;
+    return (uint32_t)p;
+}
+
+/* Box filter across: output pixel x averages source pixels x * sw / tw
+ * up to (x + 1) * sw / tw, the ones at either end by the share of them
+ * it covers. A source pixel is tw units wide, an output pixel sw. */
+static void box_across(const uint8_t *restrict src, uint16_t *restrict dst,
+                       int sw, int tw, int ch)
+{
+    if (sw == tw) {
+        for (int i = 0; i < tw * ch; i++) dst[i] = (uint16_t)(src[i] << 4);
+        return;
+    }
+    uint32_t left = (uint32_t)tw;   /* units of *src not yet used */
+    for (int x = 0; x < tw; x++, dst += ch) {
+        uint32_t sum[3] = { 0, 0, 0 }, need = (uint32_t)sw;
+        while (need) {
+            uint32_t take = left < need ? left : need;
+            for (int k = 0; k < ch; k++) sum[k] += take * src[k];
+            need -= take;
+            if (!(left -= take)) {
+                src += ch;
+                left = (uint32_t)tw;
+            }
+        }
+        for (int k = 0; k < ch; k++)
+            dst[k] = (uint16_t)((sum[k] * 16 + (uint32_t)sw / 2) / (uint32_t)sw);
+    }
+}
+
+static void bilinear_across(const uint8_t *restrict src, uint16_t *restrict dst,
+                            const uint32_t *xtab, int sw, int tw, int ch)
+{
+    for (int x = 0; x < tw; x++, dst += ch) {
+        uint32_t i = xtab[x] >> 8, f = xtab[x] & 255;
+        const uint8_t *a = src + i * ch, *b = (int)i + 1 < sw ? a + ch : a;
+        for (int k = 0; k < ch; k++)
+            dst[k] = (uint16_t)((a[k] * (256 - f) + b[k] * f + 8) >> 4);
+    }
+}
+
+/* The buffer output row y is built in: the next output row, or the
+ * row pack() reads */
+static uint8_t *resize_line(fjresize_t *rs, uint8_t **line)
+{
+    *line = rot_next(rs->c, &rs->out, rs->opts, rs->user);
+    STAGE(rs->c, STAGE_COLOR);
+    return rs->pack ? rs->mid : *line;
+}
+
+static void resize_put(fjresize_t *rs, uint8_t *line)
+{
+    if (rs->pack) rs->pack(rs->mid, line, rs->tw);
+    STAGE(rs->c, STAGE_OUTPUT);
+    put_row(rs->opts, rs->cb, rs->user, rs->y++, rs->tw, line);
+    STAGE(rs->c, STAGE_COLOR);
+}
+
+/* Box filter down: source row j covers output rows j * th / sh up to
+ * (j + 1) * th / sh, in units where it is th high and an output row sh.
+ * Each output row's weights add up to 4096. */
+static void box_down(fjresize_t *rs, int j)
+{
+    size_t n = (size_t)rs->tw * rs->ch * rs->planes;
+    const uint16_t *hv = rs->hv[0];
+    uint32_t *acc = rs->acc, sh = (uint32_t)rs->sh;
+    uint64_t top = (uint64_t)j * rs->th, end = top + rs->th;
+
+    while (rs->y < rs->th) {
+        uint64_t y0 = (uint64_t)rs->y * sh, y1 = y0 + sh;
+        if (y0 >= end) break;
+        uint32_t a = (uint32_t)((top > y0 ? top : y0) - y0);
+        uint32_t b = (uint32_t)((end < y1 ? end : y1) - y0);
+        uint32_t wgt = (b << 12) / sh - (a << 12) / sh;
+        for (size_t i = 0; i < n; i++) acc[i] += wgt * hv[i];
+        if (y1 > end) break;    /* the output row goes on below */
+
+        uint8_t *line, *o = resize_line(rs, &line);
+        for (size_t i = 0; i < n; i++) {
+            o[i] = (uint8_t)((acc[i] + (1 << 15)) >> 16);
+            acc[i] = 0;
+        }
+        resize_put(rs, line);
+    }
+}
+
+/* Bilinear down: every output row whose lower source row is j, blended
+ * from j - 1 (or j itself at the bottom edge) and j */
+static void bilinear_down(fjresize_t *rs, int j)
+{
+    size_t n = (size_t)rs->tw * rs->ch * rs->planes;
+    while (rs->y < rs->th) {
+        uint32_t p = bilinear_pos(rs->y, rs->sh, rs->th), f = p & 255;
+        int i = (int)(p >> 8);
+        if (i + (i + 1 < rs->sh) > j) break;
+
+        const uint16_t *a = rs->hv[i < j], *b = rs->hv[0];
+        uint8_t *line, *o = resize_line(rs, &line);
+        for (size_t k = 0; k < n; k++)
+            o[k] = (uint8_t)((a[k] * (256 - f) + b[k] * f + 2048) >> 12);
+        resize_put(rs, line);
+    }
+}
+
+/* fjpeg_pixel_cb for source row j of the decode */
+static void resize_row(int j, int w, const void *px, void *user)
+{
+    fjresize_t *rs = user;
+    const uint8_t *src = px;
+    (void)w;
+    if (j == 0) rs->y = 0;  /* progressive passes start over */
+    STAGE(rs->c, STAGE_COLOR);
+
+    if (rs->bilinear) {
+        uint16_t *t = rs->hv[1];
+        rs->hv[1] = rs->hv[0];
+        rs->hv[0] = t;
+    }
+    for (int p = 0; p < rs->planes; p++) {
+        const uint8_t *s = src + (size_t)p * rs->sw;
+        uint16_t *d = rs->hv[0] + (size_t)p * rs->tw;
+        if (rs->bilinear)
+            bilinear_across(s, d, rs->xtab, rs->sw, rs->tw, rs->ch);
+        else
+            box_across(s, d, rs->sw, rs->tw, rs->ch);
+    }
+    if (rs->bilinear)
+        bilinear_down(rs, j);
+    else
+        box_down(rs, j);
+}
+
+/* Scratch for the resampler: itself, its rows and the output rows */
+static size_t resize_size(const fjpeg_opts_t *opts)
+{
+    int wide = wide_formats[opts->format].format, tw = opts->target_w;
+    size_t n = (size_t)tw * formats[wide].bpp;
+    size_t size = WORK_ALIGN(sizeof(fjresize_t)) + WORK_ALIGN(n * sizeof(uint16_t));
+    if (opts->flags & FJPEG_RESIZE_BILINEAR)
+        size += WORK_ALIGN(n * sizeof(uint16_t)) + WORK_ALIGN(tw * sizeof(uint32_t));
+    else
+        size += WORK_ALIGN(n * sizeof(uint32_t));
+    if (wide_formats[opts->format].pack) size += WORK_ALIGN(n);
+    return size + out_count(opts) * WORK_ALIGN((size_t)tw * formats[opts->format].bpp);
+}
+
+/* Lay out the resampler at mem, as resize_size() sizes it, for c's
+ * decode of the caller's opts; returns the bytes used */
+static size_t resize_init(uint8_t *mem, fjctx_t *c, const fjpeg_opts_t *opts,
+                          fjpeg_row_cb cb, void *user)
+{
+    fjresize_t *rs = (fjresize_t *)mem;
+    int wide = wide_formats[opts->format].format;
+    size_t n = (size_t)opts->target_w * formats[wide].bpp;
+    size_t off = WORK_ALIGN(sizeof(fjresize_t));
+
+    memset(rs, 0, sizeof(*rs));
+    rs->c = c;
+    rs->opts = opts;
+    rs->cb = cb;
+    rs->user = user;
+    rs->pack = wide_formats[opts->format].pack;
+    rs->sw = c->roi_w;
+    rs->sh = c->roi_h;
+    rs->tw = opts->target_w;
+    rs->th = opts->target_h;
+    rs->ch = wide == FJPEG_FMT_RGB888 ? 3 : 1;
+    rs->planes = (uint8_t)(formats[wide].bpp / rs->ch);
+    rs->bilinear = (opts->flags & FJPEG_RESIZE_BILINEAR) != 0;
+
+    rs->hv[0] = (uint16_t *)(mem + off);
+    off += WORK_ALIGN(n * sizeof(uint16_t));
+    if (rs->bilinear) {
+        rs->hv[1] = (uint16_t *)(mem + off);
+        off += WORK_ALIGN(n * sizeof(uint16_t));
+        rs->xtab = (uint32_t *)(mem + off);
+        off += WORK_ALIGN(rs->tw * sizeof(uint32_t));
+        for (int x = 0; x < rs->tw; x++)
+            rs->xtab[x] = bilinear_pos(x, rs->sw, rs->tw);
+    } else {
+        rs->acc = (uint32_t *)(mem + off);
+        off += WORK_ALIGN(n * sizeof(uint32_t));
+        memset(rs->acc, 0, n * sizeof(uint32_t));
+    }
+    if (rs->pack) {
+        rs->mid = mem + off;
+        off += WORK_ALIGN(n);
+    }
+    rs->out.buf = mem + off;
+    rs->out.size = (uint32_t)WORK_ALIGN((size_t)rs->tw * formats[opts->format].bpp);
+    rs->out.n = (uint8_t)out_count(opts);
+    return off + rs->out.n * rs->out.size;
+}
+
+/*--- MCU row decode ---*/
+
+/* Copy a bs x bs pixel block into a plane */
+static inline void put_block(uint8_t *dst, size_t stride, const uint8_t *src, int bs)
+{
+    if (bs == 8) {
+        for (int r = 0; r < 8; r++) memcpy(dst + r * stride, src + r * 8, 8);
+    } else {
+        for (int r = 0; r < bs; r++) memcpy(dst + r * stride, src + r * bs, bs);
+    }
+}
+
+static inline void restart_check(fjctx_t *c)
+{
+    if (c->restart_interval) {
+        if (c->restarts_left == 0)
+            process_restart(c);
+        c->restarts_left--;
+    }
+}
+
+/* Reconstruct blk, whose highest zigzag index is last, as the bs x bs
+ * block at dst and zero it again. The IDCT is specialized by how far
+ * the coefficients reach: zigzag indices up to 2 stay inside the
+ * top-left 2x2 corner, up to 9 inside 4x4. DC-only blocks are filled in
+ * directly at every scale. */
+static FJPEG_FORCE_INLINE void put_coefs(fjctx_t *c, int16_t *blk, int last,
+                                         uint8_t *dst, size_t stride, int bs)
+{
+    STAGE(c, STAGE_IDCT);
+    STAT_ADD(c, dc_only, last == 0);
+    STAT_ADD(c, sparse, last > 0 && last <= 9);
+    if (last == 0) {
+        uint8_t v = clamp8(DESCALE(blk[0]) + 128);
+        blk[0] = 0;
+        for (int r = 0; r < bs; r++) memset(dst + r * stride, v, bs);
+    } else {
+        int cls = last <= 2 ? IDCT_2X2 : last <= 9 ? IDCT_4X4 : IDCT_FULL;
+        if (bs == 8)
+            c->idct->kern[cls](blk, c->pix);
+        else if (bs == 4)
+            c->idct->half(blk, c->pix);
+        else
+            c->idct->quarter(blk, c->pix);
+        memset(blk, 0, dirty_rows[cls] * 8 * sizeof(int16_t));
+        put_block(dst, stride, c->pix, bs);
+    }
+    STAGE(c, STAGE_HUFF);
+}
+
+/* Zero c->block without reconstructing it */
+static inline void drop_coefs(fjctx_t *c, int last)
+{
+    int cls = last == 0 ? IDCT_DC : last <= 2 ? IDCT_2X2 : last <= 9 ? IDCT_4X4 : IDCT_FULL;
+    memset(c->block, 0, dirty_rows[cls] * 8 * sizeof(int16_t));
+}
+
+/* Entropy-decode one MCU without reconstructing it: the DC predictors
+ * stay in step and the AC coefficients are only consumed */
+static int skip_mcu(fjctx_t *c)
+{
+    uint8_t px;
+    for (int i = 0; i < c->ny_h * c->ny_v; i++)
+        if (decode_block_dc_only(c, 0, &px) != 0) return -1;
+    if (c->ncomp == 3) {
+        if (decode_block_dc_only(c, 1, &px) != 0) return -1;
+        if (decode_block_dc_only(c, 2, &px) != 0) return -1;
+    }
+    return 0;
+}
+
+/* The MCU at hand could not be decoded. Under FJPEG_CONCEAL the rest of
+ * its restart interval (of the image, without restarts) is lost too and
+ * decoding resumes at the next RSTn; otherwise the decode fails. */
+static int mcu_lost(fjctx_t *c)
+{
+    if (!c->conceal) return -1;
+    c->damaged = 1;
+    c->corrupt = 0;
+    c->lost = c->restart_interval ? c->restarts_left : UINT32_MAX;
+    c->resync = 1;
+    memset(c->block, 0, sizeof(c->block));
+    return 0;
+}
+
+/* Mid-gray in place of MCU px of the planes. Earlier rows may be out
+ * already, so there is nothing better to copy. */
+static void conceal_mcu(fjctx_t *c, int px)
+{
+    int bs = c->bs, yw = c->ny_h * bs;
+    for (int r = 0; r < c->buf_rows; r++)
+        memset(c->ybuf + r * c->ystride + (size_t)px * yw, 128, yw);
+    if (c->ncomp == 3) {
+        for (int r = 0; r < bs; r++) {
+            memset(c->cbbuf + r * c->cstride + (size_t)px * bs, 128, bs);
+            memset(c->crbuf + r * c->cstride + (size_t)px * bs, 128, bs);
+        }
+    }
+}
+
+static int skip_mcus(fjctx_t *c, size_t n)
+{
+    if (c->progressive) return 0;  /* output reads the coefficient store */
+    while (n--) {
+        restart_check(c);
+        if (c->lost) {
+            c->lost--;
+            continue;
+        }
+        if ((skip_mcu(c) != 0 || stream_bad(c)) && mcu_lost(c) != 0) return -1;
+    }
+    return 0;
+}
+
+/* Decode one MCU into the planes at MCU px; see mcus_body() */
+static FJPEG_FORCE_INLINE int mcu_body(fjctx_t *c, int px, int vy0, int vy1,
+                                       int ny_h, int ny_v, int ncomp, int bs)
+{
+    size_t ys = c->ystride, cs = c->cstride;
+    uint8_t *yp = c->ybuf + (size_t)px * ny_h * bs;
+
+    /* 1/8 scale: each block is one pixel, its DC value, written
+     * straight into the planes */
+    if (bs == 1) {
+        for (int vy = 0; vy < ny_v; vy++)
+            for (int hx = 0; hx < ny_h; hx++)
+                if (decode_block_dc_only(c, 0, yp + vy * ys + hx) != 0) return -1;
+        if (ncomp == 3) {
+            if (decode_block_dc_only(c, 1, c->cbbuf + px) != 0) return -1;
+            if (decode_block_dc_only(c, 2, c->crbuf + px) != 0) return -1;
+        }
+        return 0;
+    }
+
+    /* Y blocks outside the rows kept this pass are only decoded */
+    for (int vy = 0; vy < ny_v; vy++) {
+        for (int hx = 0; hx < ny_h; hx++) {
+            int last = decode_coefs(c, 0, c->block);
+            if (last < 0) return -1;
+            if (vy >= vy0 && vy < vy1)
+                put_coefs(c, c->block, last, yp + (vy - vy0) * bs * ys + hx * bs, ys, bs);
+            else
+                drop_coefs(c, last);
+        }
+    }
+
+    if (ncomp == 3) {
+        int last = decode_coefs(c, 1, c->block);
+        if (last < 0) return -1;
+        put_coefs(c, c->block, last, c->cbbuf + px * bs, cs, bs);
+        if ((last = decode_coefs(c, 2, c->block)) < 0) return -1;
+        put_coefs(c, c->block, last, c->crbuf + px * bs, cs, bs);
+    }
+    return 0;
+}
+
+/* Decode MCUs x0..x1-1 of the current row into the planes, for ny_h x
+ * ny_v Y blocks per MCU, ncomp components and bs-pixel blocks. Y keeps
+ * buf_rows rows starting at pixel row py_base of the MCU (8 for the
+ * second H2V2 pass); Cb and Cr are always kept whole. MCUs outside
+ * mx0..mx1-1 are skipped, lost ones concealed. Inlined into every
+ * mcu_loops[] entry, which pass constants for the geometry. */
+static FJPEG_FORCE_INLINE int mcus_body(fjctx_t *c, int x0, int x1, int py_base,
+                                        int ny_h, int ny_v, int ncomp, int bs)
+{
+    int vy0 = py_base >> 3, vy1 = vy0 + c->buf_rows / bs;
+
+    for (int mcu_x = x0; mcu_x < x1; mcu_x++) {
+        STAGE(c, STAGE_HUFF);
+        restart_check(c);
+
+        int px = mcu_x - c->mx0;
+        int in = mcu_x >= c->mx0 && mcu_x < c->mx1;
+        if (c->lost) {
+            c->lost--;
+            if (in) conceal_mcu(c, px);
+            continue;
+        }
+
+        int ret = in ? mcu_body(c, px, vy0, vy1, ny_h, ny_v, ncomp, bs) : skip_mcu(c);
+        if (ret != 0 || stream_bad(c)) {
+            if (mcu_lost(c) != 0) return -1;
+            if (in) conceal_mcu(c, px);
+        }
+    }
+    return 0;
+}
+
+/* Any geometry, read from the context */
+static int mcus_any(fjctx_t *c, int x0, int x1, int py_base)
+{
+    return mcus_body(c, x0, x1, py_base, c->ny_h, c->ny_v, c->ncomp, c->bs);
+}
+
+/* Specialized layouts: name, Y blocks across, Y blocks down, components */
+#define MCU_LAYOUTS(X) \
+    X(gray, 1, 1, 1) X(h1v1, 1, 1, 3) X(h2v1, 2, 1, 3) X(h2v2, 2, 2, 3)
+
+#define MCU_LOOP(name, nh, nv, nc, bs) \
+    static int mcus_##name##_##bs(fjctx_t *c, int x0, int x1, int py_base) \
+    { return mcus_body(c, x0, x1, py_base, nh, nv, nc, bs); }
+#define MCU_LOOPS(name, nh, nv, nc) \
+    MCU_LOOP(name, nh, nv, nc, 8) MCU_LOOP(name, nh, nv, nc, 4) \
+    MCU_LOOP(name, nh, nv, nc, 2) MCU_LOOP(name, nh, nv, nc, 1)
+#define MCU_ENTRIES(name, nh, nv, nc) \
+    mcus_##name##_8, mcus_##name##_4, mcus_##name##_2, mcus_##name##_1,
+#define MCU_LAYOUT(name, nh, nv, nc) { nh, nv, nc },
+
+#if FJPEG_SPECIALIZE
+MCU_LAYOUTS(MCU_LOOPS)
+
+static const uint8_t mcu_layouts[][3] = { MCU_LAYOUTS(MCU_LAYOUT) };
+#endif
+
+/* Entry 0 is the generic loop, then one per layout and scale 1, 2, 4, 8 */
+static int (*const mcu_loops[])(fjctx_t *c, int x0, int x1, int py_base) = {
+    mcus_any,
+#if FJPEG_SPECIALIZE
+    MCU_LAYOUTS(MCU_ENTRIES)
+#endif
+};
+
+/* Pick the mcu_loops[] entry for the image, once per decode */
+static uint8_t select_mcu_loop(const fjctx_t *c)
+{
+#if FJPEG_SPECIALIZE
+    int nc = c->ncomp == 3 ? 3 : 1;
+    int sc = c->scale == 1 ? 0 : c->scale == 2 ? 1 : c->scale == 4 ? 2 : 3;
+    for (int i = 0; i < (int)(sizeof(mcu_layouts) / sizeof(mcu_layouts[0])); i++)
+        if (mcu_layouts[i][0] == c->ny_h && mcu_layouts[i][1] == c->ny_v &&
+            mcu_layouts[i][2] == nc)
+            return (uint8_t)(1 + i * 4 + sc);
+#endif
+    (void)c;
+    return 0;
+}
+
+/*--- Progressive scans ---*/
+
+/* Stored coefficients of block (bx, by) of a component */
+static inline int16_t *coef_block(const fjctx_t *c, int comp, int bx, int by)
+{
+    return c->coefs[comp] + ((size_t)by * c->coef_w[comp] + bx) * c->ncoef;
+}
+
+/* Lay out the coefficient store at mem, all zero; returns the bytes used.
+ * Blocks cover whole MCUs, as interleaved scans do. */
+static size_t set_coefs(fjctx_t *c, uint8_t *mem)
+{
+    size_t n = 0;
+    c->ncoef = c->scale == 8 ? 1 : 64;
+    for (int i = 0; i < c->ncomp; i++) {
+        int nh = i == 0 ? c->ny_h : 1, nv = i == 0 ? c->ny_v : 1;
+        size_t blocks = (size_t)c->mcus_x * nh * c->mcus_y * nv;
+        c->coefs[i] = (int16_t *)(mem + n);
+        c->coef_w[i] = (uint16_t)(c->mcus_x * nh);
+        n += WORK_ALIGN(blocks * c->ncoef * sizeof(int16_t));
+    }
+    memset(mem, 0, n);
+    return n;
+}
+
+/* First DC scan: the predicted DC, scaled by 2^al */
+static void dc_first(fjctx_t *c, int comp, int16_t *blk)
+{
+    uint8_t s = huff_decode(c, c->comp_dc[comp]);
+    uint8_t nbits = s & 0x0F;
+    c->last_dc[comp] += huff_extend(get_bits(c, nbits), nbits);
+    blk[0] = (int16_t)(c->last_dc[comp] * (1 << c->al));
+}
+
+/* DC refinement: one more bit */
+static void dc_refine(fjctx_t *c, int16_t *blk)
+{
+    if (get_bits(c, 1)) blk[0] |= (int16_t)(1 << c->al);
+}
+
+/* First scan of an AC band. EOBRUN counts the blocks after this one in
+ * which the band is all zero. */
+static int ac_first(fjctx_t *c, int comp, int16_t *blk)
+{
+    if (c->eobrun) {
+        c->eobrun--;
+        return 0;
+    }
+    int ac_tab = c->comp_ac[comp] + 2, se = c->se, al = c->al;
+#if FJPEG_HUFF_LOOKAHEAD
+    const int16_t *fast = c->fast_ac[c->comp_ac[comp]];
+#endif
+    for (int k = c->ss; k <= se; k++) {
+#if FJPEG_HUFF_LOOKAHEAD
+        fill_bits(c);
+        int16_t f = fast[c->bits >> (FJPEG_BITBUF_BITS - FJPEG_HUFF_LOOKAHEAD)];
+        if (f) {
+            k += (f >> 4) & 0x0F;
+            if (k > se) return -1;
+            c->bits <<= f & 0x0F;
+            c->nbits -= f & 0x0F;
+            blk[k] = (int16_t)((f >> 8) * (1 << al));
+            continue;
+        }
+#endif
+        uint8_t s = huff_decode(c, ac_tab);
+        uint8_t run = s >> 4;
+        uint8_t size = s & 0x0F;
+        if (size == 0) {
+            if (run == 15) { k += 15; continue; }  /* ZRL */
+            c->eobrun = (uint16_t)((1 << run) - 1);
+            if (run) c->eobrun += get_bits(c, run);
+            break;
+        }
+        k += run;
+        if (k > se) return -1;
+        blk[k] = (int16_t)(huff_extend(get_bits(c, size), size) * (1 << al));
+    }
+    return 0;
+}
+
+/* Correction bit for a coefficient already nonzero: grow its magnitude
+ * by 2^al unless that bit is already set */
+static inline void refine_coef(fjctx_t *c, int16_t *coef, int p1)
+{
+    if (get_bits(c, 1) && !(*coef & p1))
+        *coef += (int16_t)(*coef >= 0 ? p1 : -p1);
+}
+
+/* AC refinement: newly nonzero coefficients of +-2^al, each run counting
+ * only zero coefficients, with a correction bit for every nonzero one
+ * passed over, as in JPEG G.1.2.3 */
+static int ac_refine(fjctx_t *c, int comp, int16_t *blk)
+{
+    int ac_tab = c->comp_ac[comp] + 2, se = c->se, p1 = 1 << c->al;
+    int k = c->ss;
+#if FJPEG_HUFF_LOOKAHEAD
+    const int16_t *fast = c->fast_ac[c->comp_ac[comp]];
+#endif
+    if (!c->eobrun) {
+        for (; k <= se; k++) {
+            int run, v = 0;
+#if FJPEG_HUFF_LOOKAHEAD
+            /* A fused entry is a run plus a one-bit value: the sign */
+            fill_bits(c);
+            int16_t f = fast[c->bits >> (FJPEG_BITBUF_BITS - FJPEG_HUFF_LOOKAHEAD)];
+            if (f) {
+                c->bits <<= f & 0x0F;
+                c->nbits -= f & 0x0F;
+                run = (f >> 4) & 0x0F;
+                v = (f >> 8) < 0 ? -p1 : p1;
+            } else
+#endif
+            {
+                uint8_t s = huff_decode(c, ac_tab);
+                run = s >> 4;
+                if (s & 0x0F) {
+                    v = get_bits(c, 1) ? p1 : -p1;
+                } else if (run != 15) {
+                    c->eobrun = (uint16_t)(1 << run);
+                    if (run) c->eobrun += get_bits(c, run);
+                    break;
+                }
+            }
+            for (; k <= se; k++) {
+                if (blk[k]) refine_coef(c, blk + k, p1);
+                else if (--run < 0) break;
+            }
+            if (v) {
+                if (k > se) return -1;
+                blk[k] = (int16_t)v;
+            }
+        }
+    }
+    if (c->eobrun) {
+        for (; k <= se; k++)
+            if (blk[k]) refine_coef(c, blk + k, p1);
+        c->eobrun--;
+    }
+    return 0;
+}
+
+/* Move past the rest of the entropy data to the next marker other than
+ * RSTn */
+static void seek_marker(fjctx_t *c)
+{
+    while (avail(c, 2)) {
+        const uint8_t *p = c->data + c->pos;
+        if (p[0] == 0xFF && p[1] != 0 && (p[1] < 0xD0 || p[1] > 0xD7)) return;
+        c->pos++;
+    }
+}
+
+/* Decode the current scan into the coefficient store: 1 when done, 0
+ * when passed over, -1 on bad data (the blocks before it keep what they
+ * have). At 1/8 only the DC scans matter; AC scans are passed over
+ * without decoding. */
+static int decode_scan(fjctx_t *c)
+{
+    c->bits = 0;
+    c->nbits = 0;
+    c->zfill = 0;
+    c->corrupt = 0;
+    c->lost = 0;
+    c->resync = 0;
+    c->last_dc[0] = c->last_dc[1] = c->last_dc[2] = 0;
+    c->eobrun = 0;
+    c->restarts_left = c->restart_interval;
+    c->next_restart = 0;
+    if (c->ss && c->ncoef == 1) return 0;
+
+    STAGE(c, STAGE_HUFF);
+    if (c->scan_n > 1) {
+        /* Interleaved DC: MCU order, as in a baseline scan */
+        for (int my = 0; my < c->mcus_y; my++) {
+            for (int mx = 0; mx < c->mcus_x; mx++) {
+                restart_check(c);
+                for (int i = 0; i < c->scan_n; i++) {
+                    int comp = c->scan_comp[i];
+                    int nh = comp == 0 ? c->ny_h : 1, nv = comp == 0 ? c->ny_v : 1;
+                    for (int v = 0; v < nv; v++) {
+                        for (int h = 0; h < nh; h++) {
+                            int16_t *blk = coef_block(c, comp, mx * nh + h, my * nv + v);
+                            STAT_ADD(c, blocks, 1);
+                            if (c->ah) dc_refine(c, blk);
+                            else dc_first(c, comp, blk);
+                        }
+                    }
+                }
+                if (stream_bad(c) || c->lost) return -1;
+            }
+        }
+        return 1;
+    }
+
+    /* One component: its blocks in raster order, only those that hold
+     * image samples */
+    int comp = c->scan_comp[0];
+    int sub_h = comp == 0 ? 1 : c->ny_h, sub_v = comp == 0 ? 1 : c->ny_v;
+    int bw = ((c->width + sub_h - 1) / sub_h + 7) / 8;
+    int bh = ((c->height + sub_v - 1) / sub_v + 7) / 8;
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            restart_check(c);
+            int16_t *blk = coef_block(c, comp, bx, by);
+            int ret = 0;
+            STAT_ADD(c, blocks, 1);
+            if (c->ss == 0) {
+                if (c->ah) dc_refine(c, blk);
+                else dc_first(c, comp, blk);
+            } else {
+                ret = c->ah ? ac_refine(c, comp, blk) : ac_first(c, comp, blk);
+            }
+            if (ret != 0 || stream_bad(c) || c->lost) return -1;
+        }
+    }
+    return 1;
+}
+
+/* Move on to the next scan: 0 at its SOS, 1 at EOI or the end of a
+ * stream cut short, which keeps what the scans so far filled in */
+static int next_scan(fjctx_t *c)
+{
+    STAGE(c, STAGE_PARSE);
+    seek_marker(c);
+    return parse_tables(c);
+}
+
+/* Reconstruct stored coefficients at dst. At 1/8 the DC is the pixel. */
+static FJPEG_FORCE_INLINE void put_stored(fjctx_t *c, int comp, const int16_t *coef,
+                                          uint8_t *dst, size_t stride, int bs)
+{
+    const int16_t *q = c->qtab[c->comp_qtab[comp]];
+    if (bs == 1) {
+        *dst = clamp8(DESCALE(coef[0] * q[0]) + 128);
+        return;
+    }
+    int16_t *blk = c->block;
+    int last = 0;
+    blk[0] = (int16_t)(coef[0] * q[0]);
+    for (int k = 1; k < 64; k++) {
+        if (coef[k]) {
+            blk[zag[k]] = (int16_t)(coef[k] * q[k]);
+            last = k;
+        }
+    }
+    put_coefs(c, blk, last, dst, stride, bs);
+}
+
+/* mcus_body() for progressive output: MCUs x0..x1-1 of row mcu_row from
+ * the coefficient store. Nothing needs consuming outside mx0..mx1-1. */
+static int mcus_stored(fjctx_t *c, int x0, int x1, int py_base)
+{
+    int bs = c->bs, ny_h = c->ny_h, ny_v = c->ny_v;
+    int vy0 = py_base >> 3, vy1 = vy0 + c->buf_rows / bs;
+    int my = c->mcu_row;
+    size_t ys = c->ystride, cs = c->cstride;
+    if (x0 < c->mx0) x0 = c->mx0;
+    if (x1 > c->mx1) x1 = c->mx1;
+
+    for (int mcu_x = x0; mcu_x < x1; mcu_x++) {
+        int px = mcu_x - c->mx0;
+        uint8_t *yp = c->ybuf + (size_t)px * ny_h * bs;
+        for (int vy = vy0; vy < vy1; vy++)
+            for (int hx = 0; hx < ny_h; hx++)
+                put_stored(c, 0, coef_block(c, 0, mcu_x * ny_h + hx, my * ny_v + vy),
+                           yp + (vy - vy0) * bs * ys + hx * bs, ys, bs);
+        if (c->ncomp == 3) {
+            put_stored(c, 1, coef_block(c, 1, mcu_x, my), c->cbbuf + px * bs, cs, bs);
+            put_stored(c, 2, coef_block(c, 2, mcu_x, my), c->crbuf + px * bs, cs, bs);
+        }
+    }
+    return 0;
+}
+
+/*--- Pipeline ring ---*/
+
+/* FJPEG_PIPELINE: a worker entropy-decodes the MCUs the output needs into
+ * a ring of FJPEG_PIPE_MCUS slots of nblk blocks, in mcu_body() order,
+ * and the calling thread reconstructs and outputs them. Each index has
+ * one writer: head counts slots filled, tail slots drained. Blocks are
+ * all zero in a free slot; put_coefs() zeroes them again after use. */
+typedef struct fjpipe {
+    fjctx_t ctx;                /* the worker's bit reader and predictors */
+    const fjpeg_workers_t *w;
+    int16_t *blk;               /* FJPEG_PIPE_MCUS * nblk blocks */
+    uint8_t *last;              /* highest zigzag index per block, or a
+                                 * PIPE_* mark in a slot's first entry */
+    int nblk;
+    int first, end;             /* MCU rows to decode */
+    uint32_t head, tail;
+    uint8_t sleeping[2];        /* 0: calling thread, 1: worker */
+} fjpipe_t;
+
+#define PIPE_ROW 0xFD           /* the rest of the MCU row decoded too */
+#define PIPE_LOST 0xFE          /* concealed MCU */
+#define PIPE_FAIL 0xFF          /* the decode failed here; nothing follows */
+
+#if FJPEG_PIPE
+
+/* Wait for the other side to move *v on from seen. With the workers'
+ * sleep() the waiter says so in sleeping[id] and checks again before
+ * sleeping, so the post that follows cannot miss it; else it spins. */
+static void pipe_wait(fjpipe_t *p, int id, const uint32_t *v, uint32_t seen)
+{
+    const fjpeg_workers_t *w = p->w;
+    while (__atomic_load_n(v, __ATOMIC_ACQUIRE) == seen) {
+        if (!w->sleep) {
+            PIPE_RELAX();
+            continue;
+        }
+        __atomic_store_n(&p->sleeping[id], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(v, __ATOMIC_SEQ_CST) == seen)
+            w->sleep(id, w->user);
+        __atomic_store_n(&p->sleeping[id], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* Move *v on by one and wake the other side if it sleeps */
+static void pipe_post(fjpipe_t *p, int id, uint32_t *v)
+{
+    __atomic_store_n(v, *v + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->sleeping[!id], __ATOMIC_SEQ_CST))
+        p->w->wake(!id, p->w->user);
+}
+
+/* The calling thread's next filled slot, waiting while the ring is
+ * empty */
+static size_t pipe_next(fjpipe_t *p)
+{
+    pipe_wait(p, 0, &p->head, p->tail);
+    return p->tail % FJPEG_PIPE_MCUS;
+}
+
+/* mcus_body() for the calling thread: MCUs x0..x1-1 from the ring. The
+ * worker skips everything outside mx0..mx1-1 and closes each MCU row
+ * with a PIPE_ROW slot, so a row fails here just where the serial decode
+ * would fail it, before any of its pixels are out. */
+static int mcus_piped(fjctx_t *c, int x0, int x1, int py_base)
+{
+    fjpipe_t *p = c->pipe;
+    int bs = c->bs, ny_h = c->ny_h, ny_v = c->ny_v, nblk = p->nblk;
+    size_t ys = c->ystride, cs = c->cstride;
+    int row_end = x1 >= c->mcus_x;
+    (void)py_base;  /* always single-pass */
+    if (x0 < c->mx0) x0 = c->mx0;
+    if (x1 > c->mx1) x1 = c->mx1;
+
+    for (int mcu_x = x0; mcu_x < x1; mcu_x++) {
+        int px = mcu_x - c->mx0;
+        size_t slot = pipe_next(p);
+        int16_t *blk = p->blk + slot * nblk * 64;
+        const uint8_t *last = p->last + slot * nblk;
+
+        if (last[0] == PIPE_FAIL) return -1;
+        if (last[0] == PIPE_LOST) {
+            conceal_mcu(c, px);
+        } else {
+            uint8_t *yp = c->ybuf + (size_t)px * ny_h * bs;
+            for (int vy = 0; vy < ny_v; vy++)
+                for (int hx = 0; hx < ny_h; hx++, blk += 64, last++)
+                    put_coefs(c, blk, *last, yp + vy * bs * ys + hx * bs, ys, bs);
+            if (c->ncomp == 3) {
+                put_coefs(c, blk, last[0], c->cbbuf + px * bs, cs, bs);
+                put_coefs(c, blk + 64, last[1], c->crbuf + px * bs, cs, bs);
+            }
+        }
+        pipe_post(p, 0, &p->tail);
+    }
+
+    if (row_end) {
+        if (p->last[pipe_next(p) * nblk] == PIPE_FAIL) return -1;
+        pipe_post(p, 0, &p->tail);
+    }
+    return 0;
+}
+#endif
+
+static int decode_mcus(fjctx_t *c, int x0, int x1, int py_base)
+{
+    if (c->progressive) return mcus_stored(c, x0, x1, py_base);
+#if FJPEG_PIPE
+    if (c->pipe) return mcus_piped(c, x0, x1, py_base);
+#endif
+    return mcu_loops[c->mcu_loop](c, x0, x1, py_base);
+}
+
+/* Decode one row of MCUs into the planes */
+static int decode_mcu_row(fjctx_t *c, int py_base)
+{
+    return decode_mcus(c, 0, c->mcus_x, py_base);
+}
+
+/*--- MCU-row index ---*/
+
+static void put16(uint8_t *p, unsigned v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+static unsigned get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+/* Record the decoder state at the start of an MCU row. The bit buffer
+ * is prefetched, so walk back over the bytes it holds (two for each
+ * stuffed 0xFF, none for marker zero fill) to the one with the next bit.
+ * At a restart boundary the buffer is dropped anyway and pos is where
+ * the scan for RSTn starts. */
+static void index_entry(const fjctx_t *c, uint8_t *e)
+{
+    size_t p = c->pos;
+    int used = 0;
+    if (!c->restart_interval || c->restarts_left) {
+        int held = (c->nbits + 7) >> 3;
+        int real = held > c->zfill ? held - c->zfill : 0;
+        for (int i = 0; i < real; i++)
+            p -= (p >= 2 && c->data[p - 1] == 0 && c->data[p - 2] == 0xFF) ? 2 : 1;
+        if (real) used = (8 - (c->nbits & 7)) & 7;
+    }
+    memset(e, 0, FJPEG_INDEX_ENTRY);
+    put32(e, (uint32_t)(c->base + p));
+    e[4] = (uint8_t)used;
+    e[5] = c->next_restart;
+    put16(e + 6, c->restarts_left);
+    for (int i = 0; i < 3; i++) put16(e + 8 + 2 * i, (uint16_t)c->last_dc[i]);
+}
+
+/* Move the input forward to file offset off, dropping pull input */
+static int seek_forward(fjctx_t *c, size_t off)
+{
+    if (off < c->base + c->pos) return -1;
+    while (c->read && off > c->base + c->len) {
+        c->pos = c->len;
+        if (!fill_window(c, 1)) return -1;
+    }
+    if (off > c->base + c->len) return -1;
+    c->pos = off - c->base;
+    return 0;
+}
+
+/* Restore the state recorded by index_entry() */
+static int seek_row(fjctx_t *c, const uint8_t *e)
+{
+    if (seek_forward(c, get32(e)) != 0) return -1;
+    c->bits = 0;
+    c->nbits = 0;
+    c->zfill = 0;
+    c->next_restart = e[5] & 7;
+    c->restarts_left = (uint16_t)get16(e + 6);
+    for (int i = 0; i < 3; i++) c->last_dc[i] = (int16_t)get16(e + 8 + 2 * i);
+    get_bits(c, e[4] & 7);
+    return 0;
+}
+
+/* Does the index header describe this file? c is positioned at the
+ * first entropy-coded byte. */
+static int index_matches(const fjctx_t *c, const uint8_t *idx, size_t size)
+{
+    return size >= FJPEG_INDEX_HEADER + (size_t)c->mcus_y * FJPEG_INDEX_ENTRY &&
+           idx[0] == 'F' && idx[1] == 'J' && idx[2] == 'I' && idx[3] == 1 &&
+           get16(idx + 4) == c->width && get16(idx + 6) == c->height &&
+           get16(idx + 8) == c->mcus_y && get16(idx + 10) == c->restart_interval &&
+           get32(idx + 12) == c->base + c->pos;
+}
+
+/*--- Restart-interval parallel decode ---*/
+
+/* One band of MCU rows that starts on a restart boundary */
+typedef struct {
+    fjctx_t ctx;        /* private bit reader, DC predictors, block, planes */
+    uint8_t *out;       /* band output, out_w * out_mcu_h * bpp per MCU row */
+    int mcu_y0, mcu_y1;
+    int status;
+} fjjob_t;
+
+static void run_job(void *arg)
+{
+    fjjob_t *j = arg;
+    fjctx_t *c = &j->ctx;
+    size_t stride = (size_t)c->roi_w * c->buf_rows * c->bpp;
+    j->status = 0;
+#if FJPEG_STATS
+    stats_start(c, c->stats.clock, c->stats.clock_user);
+#endif
+    for (int y = j->mcu_y0; y < j->mcu_y1; y++) {
+        if (decode_mcu_row(c, 0) != 0) {
+            j->status = -1;
+            break;
+        }
+        STAGE(c, STAGE_COLOR);
+        convert_rows(c, c->buf_rows, j->out + (y - j->mcu_y0) * stride);
+    }
+#if FJPEG_STATS
+    stats_stage(c, c->stage);  /* the last stage ends here, not at the merge */
+#endif
+}
+
+static int block_side(int scale)
+{
+    return scale == 8 ? 1 : 8 / scale;
+}
+
+/* Plane scratch: Y for buf_rows rows, one block row each of Cb and Cr,
+ * and the two upsampled chroma rows. ctx_rows adds a context row above
+ * each plane for vertical fancy upsampling. */
+static size_t planes_size(size_t ystride, size_t cstride, int buf_rows, int bs, int ctx_rows)
+{
+    return WORK_ALIGN(ystride * (buf_rows + ctx_rows)) +
+           2 * WORK_ALIGN(cstride * (bs + ctx_rows)) + 2 * WORK_ALIGN(ystride);
+}
+
+/* Lay out the planes at mem; returns the bytes used */
+static size_t set_planes(fjctx_t *c, uint8_t *mem)
+{
+    int ctx_rows = c->fancy && c->v_shift;
+    size_t ys = c->ystride, cs = c->cstride;
+    size_t yplane = WORK_ALIGN(ys * (c->buf_rows + ctx_rows));
+    size_t cplane = WORK_ALIGN(cs * (c->bs + ctx_rows));
+    c->ybuf = mem + ctx_rows * ys;
+    c->cbbuf = mem + yplane + ctx_rows * cs;
+    c->crbuf = mem + yplane + cplane + ctx_rows * cs;
+    c->cbup = mem + yplane + 2 * cplane;
+    c->crup = c->cbup + WORK_ALIGN(ys);
+
+    /* Grayscale converts as YCbCr with neutral chroma */
+    if (c->ncomp == 1) {
+        memset(c->cbbuf, 128, cs * c->bs);
+        memset(c->crbuf, 128, cs * c->bs);
+    }
+    return planes_size(ys, cs, c->buf_rows, c->bs, ctx_rows);
+}
+
+/* MCU rows per band: the smallest row count that is a whole number of
+ * restart intervals, so every band begins right after an RSTn marker */
+static int band_rows(int restart_interval, int mcus_x)
+{
+    int a = restart_interval, b = mcus_x;
+    while (b) { int t = a % b; a = b; b = t; }
+    return restart_interval / a;
+}
+
+/* Entropy-data offset just past the kth RSTn marker after from, or len
+ * if the scan ends first */
+static size_t find_restart(const fjctx_t *c, size_t from, size_t k)
+{
+    const uint8_t *p = c->data + from;
+    const uint8_t *end = c->data + c->len;
+
+    while (k && p + 1 < end) {
+        p = memchr(p, 0xFF, (size_t)(end - p - 1));
+        if (!p) break;
+        if (p[1] >= 0xD0 && p[1] <= 0xD7) {
+            p += 2;
+            k--;
+        } else if (p[1] == 0xD9) {
+            break;
+        } else {
+            p++;
+        }
+    }
+    return k ? c->len : (size_t)(p - c->data);
+}
+
+/* Record the entropy-data offset of the start of the first nbands
+ * bands: scan start for band 0, just past the right RSTn marker for the
+ * rest. Bands past the end of a truncated scan start at len. */
+static void scan_restarts(const fjctx_t *c, int rows, int nbands, size_t *start)
+{
+    size_t per_band = (size_t)rows * c->mcus_x / c->restart_interval;
+    start[0] = c->pos;
+    for (int b = 1; b < nbands; b++)
+        start[b] = find_restart(c, start[b - 1], per_band);
+}
+
+/* MCU rows that hold the crop window, [*first, *last). Vertical fancy
+ * upsampling also needs the MCU row on either side. */
+static void roi_mcu_rows(const fjctx_t *c, int fancy_v, int *first, int *last)
+{
+    *first = c->roi_y / c->out_mcu_h;
+    *last = (c->roi_y + c->roi_h - 1) / c->out_mcu_h + 1;
+    if (fancy_v) {
+        if (*first > 0) (*first)--;
+        if (*last < c->mcus_y) (*last)++;
+    }
+}
+
+static inline int in_roi(const fjctx_t *c, int y)
+{
+    return y >= c->roi_y && y < c->roi_y + c->roi_h;
+}
+
+/* Skip the first n MCU rows: seek to row n with an index, else past the
+ * last restart marker before it when there is one, then entropy-decode
+ * the rest of the way */
+static int skip_rows(fjctx_t *c, int n)
+{
+    if (c->progressive) return 0;
+    if (c->index && n)
+        return seek_row(c, c->index + (size_t)n * FJPEG_INDEX_ENTRY);
+
+    size_t left = (size_t)n * c->mcus_x;
+    if (c->restart_interval && !c->read && left >= c->restart_interval) {
+        size_t k = left / c->restart_interval;
+        c->pos = find_restart(c, c->pos, k);
+        c->restarts_left = c->restart_interval;
+        c->next_restart = (uint8_t)(k & 7);
+        left -= k * c->restart_interval;
+    }
+    return skip_mcus(c, left);
+}
+
+static int decode_parallel(fjctx_t *c, const fjpeg_opts_t *opts, int rows,
+                           uint8_t *mem, fjpeg_row_cb cb, void *user)
+{
+    const fjpeg_workers_t *w = opts->workers;
+    int nbands = (c->mcus_y + rows - 1) / rows;
+    size_t band_bytes = WORK_ALIGN((size_t)c->roi_w * c->out_mcu_h * rows * c->bpp);
+    size_t plane_bytes = planes_size(c->ystride, c->cstride, c->out_mcu_h, c->bs, 0);
+    size_t job_bytes = plane_bytes + band_bytes;
+    size_t per_band = (size_t)rows * c->mcus_x / c->restart_interval;
+    int njobs = w->count < nbands ? w->count : nbands;
+
+    /* Layout matches work_body() */
+    size_t *start = (size_t *)mem;
+    fjjob_t *jobs = (fjjob_t *)(mem + WORK_ALIGN(nbands * sizeof(size_t)));
+    uint8_t *pix = (uint8_t *)jobs + WORK_ALIGN(njobs * sizeof(fjjob_t));
+
+    /* Only the bands that overlap the crop */
+    int first, last;
+    roi_mcu_rows(c, 0, &first, &last);
+    int b_first = first / rows, b_end = (last + rows - 1) / rows;
+
+    scan_restarts(c, rows, b_end, start);
+
+    for (int b0 = b_first; b0 < b_end; b0 += njobs) {
+        int n = b_end - b0 < njobs ? b_end - b0 : njobs;
+
+        for (int i = 0; i < n; i++) {
+            fjjob_t *j = &jobs[i];
+            int b = b0 + i;
+            j->ctx = *c;
+            j->ctx.pos = start[b];
+            j->ctx.restarts_left = c->restart_interval;
+            j->ctx.next_restart = (uint8_t)((b * per_band) & 7);
+            set_planes(&j->ctx, pix + i * job_bytes);
+            j->out = pix + i * job_bytes + plane_bytes;
+            j->mcu_y0 = b * rows;
+            j->mcu_y1 = j->mcu_y0 + rows < last ? j->mcu_y0 + rows : last;
+            w->run(run_job, j, w->user);
+        }
+        w->wait(w->user);
+#if FJPEG_STATS
+        /* The calling thread's time since the last stage change went to
+         * starting and waiting for jobs (or running them inline), which
+         * their own counts cover */
+        if (c->stats.clock) c->stage_t0 = c->stats.clock(c->stats.clock_user);
+        for (int i = 0; i < n; i++)
+            stats_merge(c, &jobs[i].ctx);
+#endif
+        for (int i = 0; i < n; i++)
+            c->damaged |= jobs[i].ctx.damaged;
+
+        /* Deliver pixel rows in order */
+        STAGE(c, STAGE_OUTPUT);
+        for (int i = 0; i < n; i++) {
+            if (jobs[i].status != 0) return -1;
+            int y0 = jobs[i].mcu_y0 * c->out_mcu_h;
+            int y1 = jobs[i].mcu_y1 * c->out_mcu_h;
+            for (int y = y0; y < y1; y++)
+                if (in_roi(c, y))
+                    put_row(opts, cb, user, y - c->roi_y, c->roi_w,
+                            jobs[i].out + (size_t)(y - y0) * c->roi_w * c->bpp);
+        }
+    }
+    return 0;
+}
+
+/*--- Pipelined decode ---*/
+
+#if FJPEG_PIPE
+
+/* The worker's next free slot, once the calling thread drains one if
+ * the ring is full */
+static size_t pipe_slot(fjpipe_t *p)
+{
+    uint32_t t = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE);
+    if (p->head - t == FJPEG_PIPE_MCUS) pipe_wait(p, 1, &p->tail, t);
+    return p->head % FJPEG_PIPE_MCUS;
+}
+
+/* Entropy-decode the blocks of one MCU into a slot */
+static int pipe_mcu(fjctx_t *c, int16_t *blk, uint8_t *last)
+{
+    int ny = c->ny_h * c->ny_v, n = c->ncomp == 3 ? ny + 2 : ny;
+    for (int i = 0; i < n; i++, blk += 64) {
+        int l = decode_coefs(c, i < ny ? 0 : i - ny + 1, blk);
+        if (l < 0) return -1;
+        last[i] = (uint8_t)l;
+    }
+    return 0;
+}
+
+/* Worker job: skip_rows() and mcus_body() for rows first..end-1, with
+ * every MCU inside the crop handed over through the ring. A failure
+ * takes one last slot, which ends the calling thread's decode. */
+static void pipe_run(void *arg)
+{
+    fjpipe_t *p = arg;
+    fjctx_t *c = &p->ctx;
+    size_t bytes = (size_t)p->nblk * 64 * sizeof(int16_t);
+#if FJPEG_STATS
+    stats_start(c, c->stats.clock, c->stats.clock_user);
+#endif
+    int ok = skip_rows(c, p->first) == 0;
+    for (int y = p->first; ok && y < p->end; y++) {
+        ok = skip_mcus(c, c->mx0) == 0;
+        for (int x = c->mx0; ok && x < c->mx1; x++) {
+            size_t slot = pipe_slot(p);
+            int16_t *blk = p->blk + slot * p->nblk * 64;
+            uint8_t *last = p->last + slot * p->nblk;
+            STAGE(c, STAGE_HUFF);
+            restart_check(c);
+            if (c->lost) {
+                c->lost--;
+                last[0] = PIPE_LOST;
+            } else if (pipe_mcu(c, blk, last) != 0 || stream_bad(c)) {
+                memset(blk, 0, bytes);
+                if (mcu_lost(c) != 0) {
+                    ok = 0;
+                    break;
+                }
+                last[0] = PIPE_LOST;
+            }
+            pipe_post(p, 1, &p->head);
+        }
+        if (ok) ok = skip_mcus(c, c->mcus_x - c->mx1) == 0;
+        if (ok) {
+            p->last[pipe_slot(p) * p->nblk] = PIPE_ROW;
+            pipe_post(p, 1, &p->head);
+        }
+    }
+    if (!ok) {
+        p->last[pipe_slot(p) * p->nblk] = PIPE_FAIL;
+        pipe_post(p, 1, &p->head);
+    }
+#if FJPEG_STATS
+    stats_stage(c, c->stage);
+#endif
+}
+
+#endif
+
+/*--- Scratch memory ---*/
+
+/* Header fields that decide how much scratch a decode needs */
+typedef struct {
+    uint16_t width, height;
+    uint8_t mcu_w, mcu_h;
+    uint16_t restart_interval;
+    uint8_t ncomp;
+    uint8_t progressive;
+    uint8_t hsamp[3], vsamp[3];
+    size_t sos;              /* offset of the first SOS marker, 0 if none */
+    size_t exif, exif_len;   /* EXIF thumbnail, 0 if none */
+} fjhdr_t;
+
+static void ctx_hdr(const fjctx_t *c, fjhdr_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->width = c->width;
+    h->height = c->height;
+    h->mcu_w = c->mcu_w;
+    h->mcu_h = c->mcu_h;
+    h->restart_interval = c->restart_interval;
+    h->ncomp = c->ncomp;
+    h->progressive = c->progressive;
+    for (int i = 0; i < 3; i++) {
+        h->hsamp[i] = c->hsamp[i];
+        h->vsamp[i] = c->vsamp[i];
+    }
+}
+
+static uint32_t tiff_u16(const uint8_t *p, int be)
+{
+    return be ? (uint32_t)p[0] << 8 | p[1] : (uint32_t)p[1] << 8 | p[0];
+}
+
+static uint32_t tiff_u32(const uint8_t *p, int be)
+{
+    return be ? tiff_u16(p, 1) << 16 | tiff_u16(p + 2, 1)
+              : tiff_u16(p + 2, 0) << 16 | tiff_u16(p, 0);
+}
+
+/* The JPEG thumbnail of an APP1 EXIF segment (s, n bytes of its body),
+ * as an offset into the body; 0 if there is none. Only IFD0's link to
+ * IFD1 and IFD1's own entries are read. */
+static size_t exif_thumb(const uint8_t *s, size_t n, size_t *len)
+{
+    *len = 0;
+    if (n < 6 + 8 || memcmp(s, "Exif\0\0", 6) != 0) return 0;
+    const uint8_t *t = s + 6;    /* TIFF header: offsets count from here */
+    size_t tn = n - 6;
+    int be = t[0] == 'M';
+    if (t[0] != t[1] || (t[0] != 'I' && t[0] != 'M') || tiff_u16(t + 2, be) != 42)
+        return 0;
+
+    size_t ifd = tiff_u32(t + 4, be), cnt;
+    if (ifd > tn - 2) return 0;
+    cnt = tiff_u16(t + ifd, be);
+    if (cnt * 12 + 6 > tn - ifd) return 0;
+    ifd = tiff_u32(t + ifd + 2 + cnt * 12, be);
+    if (ifd == 0 || ifd > tn - 2) return 0;
+    cnt = tiff_u16(t + ifd, be);
+    if (cnt * 12 + 2 > tn - ifd) return 0;
+
+    size_t off = 0, size = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        const uint8_t *e = t + ifd + 2 + i * 12;
+        uint32_t v = tiff_u16(e + 2, be) == 3 ? tiff_u16(e + 8, be) : tiff_u32(e + 8, be);
+        switch (tiff_u16(e, be)) {
+            case 0x0201: off = v; break;    /* JPEGInterchangeFormat */
+            case 0x0202: size = v; break;   /* ...Length */
+        }
+    }
+    if (!off || size < 4 || off > tn || size > tn - off) return 0;
+    if (t[off] != 0xFF || t[off + 1] != 0xD8) return 0;
+    *len = size;
+    return 6 + off;
+}
+
+/* Walk the markers up to SOS without building any tables, rejecting
+ * the frames parse_sof() rejects */
+static int read_header(const uint8_t *p, size_t len, fjhdr_t *h)
+{
+    size_t i = 2;
+    int have_sof = 0;
+    memset(h, 0, sizeof(*h));
+    if (len < 2 || p[0] != 0xFF || p[1] != 0xD8) return -1;
+    while (i + 2 <= len) {
+        /* Fill bytes (0xFF runs) and stray data until the next marker */
+        if (p[i] != 0xFF || p[i + 1] == 0xFF) { i++; continue; }
+        uint8_t marker = p[i + 1];
+        if (marker == 0xDA) h->sos = i;
+        if (marker == 0xD9 || marker == 0xDA) break;
+        if (marker == 0x00 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            i += 2;    /* no length field */
+            continue;
+        }
+        if (i + 4 > len) break;
+        size_t mlen = (size_t)p[i + 2] << 8 | p[i + 3];
+        if (mlen < 2) return -1;
+        const uint8_t *s = p + i + 4;    /* segment body, n bytes of it here */
+        size_t n = mlen - 2 < len - i - 4 ? mlen - 2 : len - i - 4;
+
+        if (marker == 0xC0 || marker == 0xC2) {
+            if (have_sof || n < 6 || s[0] != 8) return -1;
+            h->height = (uint16_t)(s[1] << 8 | s[2]);
+            h->width  = (uint16_t)(s[3] << 8 | s[4]);
+            h->ncomp = s[5];
+            if ((h->ncomp != 1 && h->ncomp != 3) || n < 6 + 3 * (size_t)h->ncomp) return -1;
+            for (int k = 0; k < h->ncomp; k++) {
+                h->hsamp[k] = s[7 + 3 * k] >> 4;
+                h->vsamp[k] = s[7 + 3 * k] & 0x0F;
+            }
+            if (!valid_sampling(h->ncomp, h->hsamp, h->vsamp)) return -1;
+            h->mcu_w = h->ncomp == 1 ? 8 : h->hsamp[0] * 8;
+            h->mcu_h = h->ncomp == 1 ? 8 : h->vsamp[0] * 8;
+            h->progressive = marker == 0xC2;
+            have_sof = 1;
+        }
+        if (marker == 0xDD && n >= 2)
+            h->restart_interval = (uint16_t)(s[0] << 8 | s[1]);
+        if (marker == 0xE1 && !h->exif_len) {
+            size_t off = exif_thumb(s, n, &h->exif_len);
+            if (off) h->exif = i + 4 + off;
+        }
+        i += 2 + mlen;
+    }
+    return have_sof ? 0 : -1;
+}
 
-    if (parse_markers(&ctx) != 0) return -1;
-    if (ctx.width == 0 || ctx.height == 0) return -1;
+/* Fancy upsampling reaches into neighbouring MCUs, so tiles, which are
+ * converted as soon as their own MCUs are decoded, always replicate */
+static int fancy_mode(const fjpeg_opts_t *opts)
+{
+    return (opts->flags & FJPEG_FANCY_UPSAMPLING) && !opts->tile_cb;
+}
 
-    /* Init restart state */
-    if (ctx.restart_interval) {
-        ctx.restarts_left = ctx.restart_interval;
-        ctx.next_restart = 0;
+/* Vertical fancy upsampling: H2V2 chroma filtered across rows, which
+ * ties each MCU row to the next */
+static int fancy_v_mode(const fjhdr_t *h, const fjpeg_opts_t *opts)
+{
+    return fancy_mode(opts) && h->mcu_h > 8;
+}
+
+/* MCUs per tile: tile_mcus (0 = 1), at most the n columns of the crop */
+static int tile_group(const fjpeg_opts_t *opts, int n)
+{
+    int g = opts->tile_mcus ? opts->tile_mcus : 1;
+    return g < n ? g : n;
+}
+
+/* Restart-interval band height when the parallel path applies, else 0.
+ * Parallel decode seeks, so pull input always decodes serially, and
+ * bands cannot see their neighbours' chroma for vertical fancy
+ * upsampling. Band buffers are reused as soon as their rows are out,
+ * so they never join an output rotation. */
+static int parallel_rows(const fjhdr_t *h, const fjpeg_opts_t *opts)
+{
+    const fjpeg_workers_t *w = opts->workers;
+    if (!w || w->count < 2 || opts->read || opts->tile_cb || opts->out_bufs > 1 ||
+        h->progressive || !h->restart_interval || !h->mcu_w || !h->mcu_h)
+        return 0;
+    if (fancy_v_mode(h, opts)) return 0;
+    int mcus_x = (h->width + h->mcu_w - 1) / h->mcu_w;
+    int mcus_y = (h->height + h->mcu_h - 1) / h->mcu_h;
+    int rows = band_rows(h->restart_interval, mcus_x);
+    return rows < mcus_y ? rows : 0;
+}
+
+/* FJPEG_PIPELINE on the serial row path. Restart bands spread the work
+ * further where they apply, progressive output has no entropy data left
+ * to decode alongside it and at 1/8 there is no IDCT to take off the
+ * entropy decoder. */
+static int pipe_mode(const fjhdr_t *h, const fjpeg_opts_t *opts)
+{
+    const fjpeg_workers_t *w = opts->workers;
+    if (!FJPEG_PIPE || !(opts->flags & FJPEG_PIPELINE) || !w || w->count < 1)
+        return 0;
+    return opts->scale != 8 && !opts->tile_cb && !h->progressive && !parallel_rows(h, opts);
+}
+
+/* Blocks per MCU, a pipeline slot */
+static int pipe_blocks(const fjhdr_t *h)
+{
+    return (h->mcu_w / 8) * (h->mcu_h / 8) + (h->ncomp == 3 ? 2 : 0);
+}
+
+/* The ring after the worker's context: the blocks, then the zigzag
+ * indices */
+static size_t pipe_size(const fjhdr_t *h)
+{
+    size_t n = (size_t)FJPEG_PIPE_MCUS * pipe_blocks(h);
+    return WORK_ALIGN(sizeof(fjpipe_t)) + n * 64 * sizeof(int16_t) + WORK_ALIGN(n);
+}
+
+/* The options the decode runs with. For a target size that is the
+ * smallest scale still covering it (1:1 when the image is smaller), the
+ * format the resampler reads and rows that go to resize_row(). */
+static void fit_opts(const fjhdr_t *h, const fjpeg_opts_t *opts, fjpeg_opts_t *o)
+{
+    *o = *opts;
+    if (!opts->target_w) return;
+    int scale = 8;
+    while (scale > 1 && (h->width / scale < opts->target_w || h->height / scale < opts->target_h))
+        scale >>= 1;
+    o->scale = scale;
+    o->format = wide_formats[opts->format].format;
+    o->pixel_cb = resize_row;
+    o->out_bufs = 0;
+    o->out_wait = NULL;
+    o->target_w = o->target_h = 0;
+}
+
+/* H2V2 at 1:1 decodes each MCU row twice into an 8-row buffer, unless the
+ * caller asks for a 16-row buffer instead. Pull input cannot rewind,
+ * fancy upsampling needs the chroma rows of both halves, tiles hold
+ * whole MCUs anyway and the pipeline hands over each MCU once. */
+static int two_pass_mode(const fjhdr_t *h, const fjpeg_opts_t *opts)
+{
+    return opts->scale == 1 && h->mcu_h > 8 && !opts->read && !opts->tile_cb &&
+           !(opts->flags & (FJPEG_SINGLE_PASS | FJPEG_FANCY_UPSAMPLING)) &&
+           !pipe_mode(h, opts);
+}
+
+/* The crop window, or the whole output when none is set; -1 if it does
+ * not fit inside the output */
+static int roi_rect(const fjpeg_opts_t *opts, int out_w, int out_h, fjpeg_rect_t *r)
+{
+    *r = opts->roi;
+    if (r->w == 0 || r->h == 0) {
+        r->x = r->y = 0;
+        r->w = out_w;
+        r->h = out_h;
+        return 0;
     }
+    if (r->x < 0 || r->y < 0 || r->w < 0 || r->h < 0 ||
+        r->x > out_w - r->w || r->y > out_h - r->h)
+        return -1;
+    return 0;
+}
 
-    /* Output dimensions */
-    int out_w = ctx.width / scale;
-    int out_h = ctx.height / scale;
-    if (out_w == 0 || out_h == 0) return -1;
+/* MCU columns covering output columns x..x+w-1, mcu_out_w pixels each,
+ * widened by one each side for fancy horizontal upsampling */
+static void roi_mcu_cols(int mcus_x, int mcu_out_w, const fjpeg_rect_t *r, int widen,
+                         int *mx0, int *mx1)
+{
+    *mx0 = r->x / mcu_out_w;
+    *mx1 = (r->x + r->w + mcu_out_w - 1) / mcu_out_w;
+    if (widen) {
+        if (*mx0 > 0) (*mx0)--;
+        if (*mx1 < mcus_x) (*mx1)++;
+    }
+}
+
+static size_t window_size(const fjpeg_opts_t *opts)
+{
+    return opts->window ? opts->window : FJPEG_STREAM_WINDOW;
+}
+
+/* Scratch head: the context, plus the read window for pull input */
+static size_t work_head(const fjpeg_opts_t *opts)
+{
+    size_t n = WORK_ALIGN(sizeof(fjctx_t));
+    if (opts->read) n += WORK_ALIGN(window_size(opts));
+    return n;
+}
+
+/* Blocks in the progressive coefficient store: whole MCUs of every
+ * component */
+static size_t coef_blocks(const fjhdr_t *h)
+{
+    size_t mcus = (size_t)((h->width + h->mcu_w - 1) / h->mcu_w) *
+                  ((h->height + h->mcu_h - 1) / h->mcu_h);
+    return mcus * (h->mcu_w / 8) * (h->mcu_h / 8) + (h->ncomp == 3 ? 2 * mcus : 0);
+}
+
+/* Largest store whose size still fits comfortably in a size_t */
+#define COEF_MAX_BLOCKS (SIZE_MAX / 4 / (64 * sizeof(int16_t)))
+
+/* The coefficient store: 64 coefficients per block, the DC alone at 1/8,
+ * each component padded to 8 bytes as set_coefs() lays it out */
+static size_t coef_size(const fjhdr_t *h, int scale)
+{
+    if (!h->progressive) return 0;
+    return (coef_blocks(h) * (scale == 8 ? 1 : 64)) * sizeof(int16_t) + 3 * 8;
+}
 
-    /* Output MCU height and row buffer sizing */
-    int out_mcu_h = ctx.mcu_h / scale;
+/* Scratch body: the resampler for a target size, the progressive
+ * coefficient store or the pipeline, then the planes and the output
+ * rows, the planes and the output tiles for tile output or, for
+ * parallel decode, band offsets, jobs and per-job planes and band
+ * output */
+static size_t work_body(const fjhdr_t *h, const fjpeg_opts_t *opts)
+{
+    if (opts->target_w) {
+        fjpeg_opts_t o;
+        fit_opts(h, opts, &o);
+        return resize_size(opts) + work_body(h, &o);
+    }
+
+    int scale = opts->scale, bs = block_side(scale);
+    int out_mcu_h = h->mcu_h / scale;
     if (out_mcu_h < 1) out_mcu_h = 1;
 
-    /* Two-pass needed for H2V2 at 1:1 (mcu_h=16, but we only buffer 8 rows) */
-    int two_pass = (scale == 1 && ctx.mcu_h > 8);
-    int buf_rows = two_pass ? 8 : out_mcu_h;
+    fjpeg_rect_t r;
+    roi_rect(opts, h->width / scale, h->height / scale, &r);
+    int mcus_x = (h->width + h->mcu_w - 1) / h->mcu_w, mx0, mx1;
+    roi_mcu_cols(mcus_x, h->mcu_w / 8 * bs, &r, fancy_mode(opts) && h->mcu_w > 8, &mx0, &mx1);
+    size_t ystride = (size_t)(mx1 - mx0) * (h->mcu_w / 8) * bs;
+    size_t cstride = (size_t)(mx1 - mx0) * bs;
+    size_t row = (size_t)r.w * formats[opts->format].bpp;
+
+    size_t coefs = coef_size(h, scale);
+
+    if (opts->tile_cb) {
+        int g = tile_group(opts, mx1 - mx0);
+        ystride = (size_t)g * (h->mcu_w / 8) * bs;
+        return coefs + planes_size(ystride, (size_t)g * bs, out_mcu_h, bs, 0) +
+               out_count(opts) * WORK_ALIGN(ystride * out_mcu_h * formats[opts->format].bpp);
+    }
+
+    int rows = parallel_rows(h, opts);
+    if (rows) {
+        int mcus_y = (h->height + h->mcu_h - 1) / h->mcu_h;
+        int nbands = (mcus_y + rows - 1) / rows;
+        int njobs = opts->workers->count < nbands ? opts->workers->count : nbands;
+        return WORK_ALIGN(nbands * sizeof(size_t)) +
+               WORK_ALIGN(njobs * sizeof(fjjob_t)) +
+               njobs * (planes_size(ystride, cstride, out_mcu_h, bs, 0) +
+                        WORK_ALIGN(row * out_mcu_h * rows));
+    }
+    int buf_rows = two_pass_mode(h, opts) ? 8 : out_mcu_h;
+    size_t pipe = pipe_mode(h, opts) ? pipe_size(h) : 0;
+    return coefs + pipe + planes_size(ystride, cstride, buf_rows, bs, fancy_v_mode(h, opts)) +
+           out_count(opts) * WORK_ALIGN(row);
+}
+
+/*--- Main decode ---*/
+
+int fjpeg_info(const void *data, size_t len, fjpeg_info_t *info)
+{
+    fjhdr_t h;
+    if (read_header(data, len, &h) != 0) return -1;
+    info->width = h.width;
+    info->height = h.height;
+    return 0;
+}
+
+static int valid_opts(const fjpeg_opts_t *opts)
+{
+    int scale = opts->scale;
+    if (opts->target_w || opts->target_h) {
+        /* The scale is picked per image, and only whole images resample
+         * to rows */
+        if (opts->target_w <= 0 || opts->target_h <= 0 ||
+            opts->target_w > 0xFFFF || opts->target_h > 0xFFFF) return 0;
+        if (opts->tile_cb || opts->roi.w || opts->roi.h) return 0;
+    } else if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        return 0;
+    }
+    if (opts->read && opts->window && opts->window < 16) return 0;
+    if (opts->format < 0 || opts->format >= NUM_FORMATS) return 0;
+    /* Only RGB565 fits fjpeg_row_cb */
+    if (opts->format > FJPEG_FMT_RGB565_LE && !opts->pixel_cb && !opts->tile_cb) return 0;
+    if (opts->tile_mcus < 0) return 0;
+    if (opts->out_bufs < 0 || opts->out_bufs > 255) return 0;
+    if (opts->scans < 0) return 0;
+    return 1;
+}
+
+static size_t hdr_work_size(const fjhdr_t *h, const fjpeg_opts_t *opts)
+{
+    fjpeg_opts_t o;
+    fit_opts(h, opts, &o);
+    if (h->width / o.scale == 0 || h->height / o.scale == 0) return 0;
+    if (h->progressive && coef_blocks(h) > COEF_MAX_BLOCKS) return 0;
+    fjpeg_rect_t r;
+    if (roi_rect(&o, h->width / o.scale, h->height / o.scale, &r) != 0) return 0;
+    return work_head(opts) + work_body(h, opts);
+}
+
+size_t fjpeg_work_size(const void *data, size_t len, const fjpeg_opts_t *opts)
+{
+    fjhdr_t h;
+    if (!valid_opts(opts)) return 0;
+    if (read_header(data, len, &h) != 0) return 0;
+    return hdr_work_size(&h, opts);
+}
+
+int fjpeg_probe(const void *data, size_t len, fjpeg_probe_t *p)
+{
+    fjhdr_t h;
+    memset(p, 0, sizeof(*p));
+    if (read_header(data, len, &h) != 0) return -1;
+    p->width = h.width;
+    p->height = h.height;
+    p->ncomp = h.ncomp;
+    for (int i = 0; i < h.ncomp; i++) {
+        p->hsamp[i] = h.hsamp[i];
+        p->vsamp[i] = h.vsamp[i];
+    }
+    p->progressive = h.progressive;
+    p->mcu_w = h.mcu_w;
+    p->mcu_h = h.mcu_h;
+    p->restart_interval = h.restart_interval;
+    p->sos = h.sos;
+    p->exif_thumb = h.exif;
+    p->exif_thumb_len = h.exif_len;
+
+    fjpeg_opts_t o;
+    memset(&o, 0, sizeof(o));
+    for (int i = 0; i < 4; i++) {
+        o.scale = 1 << i;
+        p->work_size[i] = hdr_work_size(&h, &o);
+    }
+    return 0;
+}
+
+int fjpeg_exif_thumbnail(const void *data, size_t len, const void **thumb, size_t *thumb_len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i = 2;
+    *thumb = NULL;
+    *thumb_len = 0;
+    if (len < 2 || p[0] != 0xFF || p[1] != 0xD8) return -1;
+    while (i + 4 <= len) {
+        if (p[i] != 0xFF || p[i + 1] == 0xFF) { i++; continue; }
+        uint8_t marker = p[i + 1];
+        if (marker == 0xD9 || marker == 0xDA) break;
+        if (marker == 0x00 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            i += 2;
+            continue;
+        }
+        size_t mlen = (size_t)p[i + 2] << 8 | p[i + 3];
+        if (mlen < 2) break;
+        const uint8_t *s = p + i + 4;
+        size_t n = mlen - 2 < len - i - 4 ? mlen - 2 : len - i - 4;
+        if (marker == 0xE1 && n >= 6 && memcmp(s, "Exif\0\0", 6) == 0) {
+            size_t off = exif_thumb(s, n, thumb_len);
+            if (!off) return -1;
+            *thumb = s + off;
+            return 0;
+        }
+        i += 2 + mlen;
+    }
+    return -1;
+}
+
+int fjpeg_decode(const void *data, size_t len, int scale,
+                 fjpeg_row_cb cb, void *user)
+{
+    fjpeg_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.scale = scale;
+    return fjpeg_decode_ex(data, len, &opts, cb, user);
+}
+
+/* Set up the context at the start of mem (see work_head()) and parse
+ * the headers up to the entropy data */
+static int decode_setup(uint8_t *mem, const void *data, size_t len,
+                        const fjpeg_opts_t *opts)
+{
+    fjctx_t *c = (fjctx_t *)mem;
+    int keep = (opts->flags & FJPEG_KEEP_TABLES) && mem == opts->work;
+    memset(c, 0, keep ? offsetof(fjctx_t, qtab) : sizeof(*c));
+    if (opts->read) {
+        c->read = opts->read;
+        c->read_user = opts->read_user;
+        c->win = mem + WORK_ALIGN(sizeof(fjctx_t));
+        c->win_size = window_size(opts);
+        c->data = c->win;
+    } else {
+        c->data = data;
+        c->len = len;
+    }
+    c->accurate = (opts->flags & FJPEG_ACCURATE_IDCT) != 0;
+    c->idct = idct_select(c->accurate);
+    c->conceal = (opts->flags & FJPEG_CONCEAL) != 0;
+#if FJPEG_STATS
+    if (opts->stats) stats_start(c, opts->stats->clock, opts->stats->clock_user);
+#endif
+
+    STAGE(c, STAGE_PARSE);
+    if (parse_markers(c) != 0) return -1;
+    if (c->width == 0 || c->height == 0) return -1;
+
+    /* The coefficient store is sized from the header */
+    fjhdr_t h;
+    ctx_hdr(c, &h);
+    if (c->progressive && (!c->mcu_w || !c->mcu_h || coef_blocks(&h) > COEF_MAX_BLOCKS))
+        return -1;
+
+    /* A target size picks the scale and format from the header */
+    fjpeg_opts_t fit;
+    fit_opts(&h, opts, &fit);
+    opts = &fit;
+    int scale = opts->scale;
+    c->scale = (uint8_t)scale;
+    c->convert = formats[opts->format].fn;
+    c->bpp = formats[opts->format].bpp;
+
+    /* Progressive output reads the store, so an index has nothing to seek */
+    if (opts->index) {
+        if (c->progressive || !index_matches(c, opts->index, opts->index_size)) return -1;
+        c->index = (const uint8_t *)opts->index + FJPEG_INDEX_HEADER;
+    }
+
+    /* Init restart state */
+    if (c->restart_interval) {
+        c->restarts_left = c->restart_interval;
+        c->next_restart = 0;
+    }
 
-    /* Allocate row buffer */
-    uint16_t *row_buf = malloc((size_t)out_w * buf_rows * sizeof(uint16_t));
-    if (!row_buf) return -1;
+    /* Output dimensions */
+    c->out_w = c->width / scale;
+    c->out_h = c->height / scale;
+    if (c->out_w == 0 || c->out_h == 0) return -1;
+
+    /* Output MCU height */
+    c->out_mcu_h = c->mcu_h / scale;
+    if (c->out_mcu_h < 1) c->out_mcu_h = 1;
 
     /* Chroma subsampling shifts */
-    int h_shift = (ctx.ncomp > 1 && ctx.hsamp[0] > 1) ? 1 : 0;
-    int v_shift = (ctx.ncomp > 1 && ctx.vsamp[0] > 1) ? 1 : 0;
+    c->h_shift = (c->ncomp > 1 && c->hsamp[0] > 1) ? 1 : 0;
+    c->v_shift = (c->ncomp > 1 && c->vsamp[0] > 1) ? 1 : 0;
 
     /* Number of 8x8 Y blocks per MCU */
-    int ny_h = ctx.ncomp == 1 ? 1 : ctx.hsamp[0];
-    int ny_v = ctx.ncomp == 1 ? 1 : ctx.vsamp[0];
+    c->ny_h = c->ncomp == 1 ? 1 : c->hsamp[0];
+    c->ny_v = c->ncomp == 1 ? 1 : c->vsamp[0];
+
+    c->fancy = (uint8_t)fancy_mode(opts);
+
+    /* Crop window and the MCU columns it needs */
+    fjpeg_rect_t r;
+    if (roi_rect(opts, c->out_w, c->out_h, &r) != 0) return -1;
+    int mcu_out_w, mx0, mx1;
+    c->bs = (uint8_t)block_side(scale);
+    mcu_out_w = c->ny_h * c->bs;
+    roi_mcu_cols(c->mcus_x, mcu_out_w, &r, c->fancy && c->h_shift, &mx0, &mx1);
+    c->roi_y = (uint16_t)r.y;
+    c->roi_w = (uint16_t)r.w;
+    c->roi_h = (uint16_t)r.h;
+    c->mx0 = (uint16_t)mx0;
+    c->mx1 = (uint16_t)mx1;
+    c->ox = (uint16_t)(r.x - mx0 * mcu_out_w);
 
-    /* Block storage */
-    uint8_t y_blocks[4][64];
-    uint8_t cb_block[64], cr_block[64];
+    /* Plane strides: whole MCUs, so blocks never straddle the edge; one
+     * tile's worth for tile output */
+    int cols = opts->tile_cb ? tile_group(opts, mx1 - mx0) : mx1 - mx0;
+    c->ystride = (uint32_t)cols * mcu_out_w;
+    c->cstride = (uint32_t)cols * c->bs;
+
+    c->need_chroma = opts->format != FJPEG_FMT_Y8;
+    select_upsample(c);
+    c->mcu_loop = select_mcu_loop(c);
+    c->out.n = (uint8_t)out_count(opts);
+    return 0;
+}
+
+/* Tile output: each group of MCUs is converted into the tile buffer and
+ * handed over as soon as it is decoded, clipped to the crop. mx0/mx1,
+ * ox and roi_w then describe the current tile rather than the crop. */
+static int decode_tiles(fjctx_t *c, const fjpeg_opts_t *opts, uint8_t *body, void *user)
+{
+    int mcu_out_w = c->ny_h * c->bs, out_mcu_h = c->out_mcu_h;
+    int cm0 = c->mx0, cm1 = c->mx1;
+    int rx0 = cm0 * mcu_out_w + c->ox, rx1 = rx0 + c->roi_w;
+    int ry0 = c->roi_y, ry1 = ry0 + c->roi_h;
+    int group = (int)c->ystride / mcu_out_w;
+
+    c->buf_rows = out_mcu_h;
+    c->out.buf = body + set_planes(c, body);
+    c->out.size = (uint32_t)WORK_ALIGN(c->ystride * out_mcu_h * c->bpp);
+
+    int first, last;
+    roi_mcu_rows(c, 0, &first, &last);
+    if (skip_rows(c, first) != 0) return -1;
+    uint16_t ox = c->ox, roi_w = c->roi_w;
+
+    for (int mcu_y = first; mcu_y < last; mcu_y++) {
+        int base_y = mcu_y * out_mcu_h;
+        int ty0 = base_y > ry0 ? base_y : ry0;
+        int ty1 = base_y + out_mcu_h < ry1 ? base_y + out_mcu_h : ry1;
+        c->mcu_row = (uint16_t)mcu_y;
+
+        if (skip_mcus(c, cm0) != 0) return -1;
+        for (int gx = cm0; gx < cm1; gx += group) {
+            int gend = gx + group < cm1 ? gx + group : cm1;
+            c->mx0 = (uint16_t)gx;
+            c->mx1 = (uint16_t)gend;
+            if (decode_mcus(c, gx, gend, 0) != 0) return -1;
+
+            int tx0 = gx * mcu_out_w > rx0 ? gx * mcu_out_w : rx0;
+            int tx1 = gend * mcu_out_w < rx1 ? gend * mcu_out_w : rx1;
+            c->ox = (uint16_t)(tx0 - gx * mcu_out_w);
+            c->roi_w = (uint16_t)(tx1 - tx0);
+            select_upsample(c);
+
+            uint8_t *tile = next_out(c, opts, user);
+            STAGE(c, STAGE_COLOR);
+            size_t stride = (size_t)c->roi_w * c->bpp;
+            for (int y = ty0; y < ty1; y++)
+                convert_plane_row(c, y - base_y, y - base_y, tile + (y - ty0) * stride);
+            STAGE(c, STAGE_OUTPUT);
+            opts->tile_cb(tx0 - rx0, ty0 - ry0, tx1 - tx0, ty1 - ty0, tile, user);
+        }
+        if (skip_mcus(c, c->mcus_x - cm1) != 0) return -1;
+    }
+
+    /* Back to the crop, for the next progressive pass */
+    c->mx0 = (uint16_t)cm0;
+    c->mx1 = (uint16_t)cm1;
+    c->ox = ox;
+    c->roi_w = roi_w;
+    select_upsample(c);
+    return 0;
+}
 
-    /* Scaled block storage for 1/4 mode */
-    uint8_t y_2x2[4][4];
-    uint8_t cb_2x2[4], cr_2x2[4];
+/* The serial row loop: decode an MCU row (or, with the pipeline, take it
+ * from the ring), convert it and deliver its rows */
+static int decode_rows(fjctx_t *c, const fjpeg_opts_t *opts, uint8_t *body,
+                       fjpeg_row_cb cb, void *user)
+{
+    fjhdr_t h;
+    ctx_hdr(c, &h);
+    int two_pass = two_pass_mode(&h, opts);
+    int fancy_v = fancy_v_mode(&h, opts);
+    c->buf_rows = two_pass ? 8 : c->out_mcu_h;
+    int buf_rows = c->buf_rows, roi_w = c->roi_w;
+    size_t ys = c->ystride, cs = c->cstride;
 
+    c->out.buf = body + set_planes(c, body);
+    c->out.size = (uint32_t)WORK_ALIGN((size_t)roi_w * c->bpp);
+    uint8_t *line;
     decode_save_t saved = {0};
 
-    for (int mcu_y = 0; mcu_y < ctx.mcus_y; mcu_y++) {
+    /* Only the MCU rows that hold the crop are decoded */
+    int first, last;
+    roi_mcu_rows(c, fancy_v, &first, &last);
+    if (!c->pipe && skip_rows(c, first) != 0) return -1;
+
+    for (int mcu_y = first; mcu_y < last; mcu_y++) {
         int passes = two_pass ? 2 : 1;
+        c->mcu_row = (uint16_t)mcu_y;
 
         if (two_pass)
-            save_state(&ctx, &saved);
+            save_state(c, &saved);
 
         for (int pass = 0; pass < passes; pass++) {
             if (pass == 1)
-                restore_state(&ctx, &saved);
+                restore_state(c, &saved);
 
             /* py_base: which pixel row within the MCU this pass starts at */
             int py_base = two_pass ? (pass * 8) : 0;
 
-            memset(row_buf, 0, (size_t)out_w * buf_rows * sizeof(uint16_t));
+            if (decode_mcu_row(c, py_base) != 0)
+                return -1;
 
-            for (int mcu_x = 0; mcu_x < ctx.mcus_x; mcu_x++) {
-                /* Restart interval check */
-                if (ctx.restart_interval) {
-                    if (ctx.restarts_left == 0)
-                        process_restart(&ctx);
-                    ctx.restarts_left--;
+            int base_y = mcu_y * c->out_mcu_h + py_base;
+            int nrows = buf_rows;
+            if (fancy_v) {
+                /* The previous MCU row's last row, held back for the
+                 * chroma row below it; at the top, replicate the edge */
+                STAGE(c, STAGE_COLOR);
+                if (mcu_y == 0) {
+                    memcpy(c->cbbuf - cs, c->cbbuf, cs);
+                    memcpy(c->crbuf - cs, c->crbuf, cs);
+                } else if (in_roi(c, base_y - 1)) {
+                    line = next_out(c, opts, user);
+                    STAGE(c, STAGE_COLOR);
+                    convert_row(c, c->ybuf - ys, c->cbbuf - cs, c->cbbuf,
+                                c->crbuf - cs, c->crbuf, line);
+                    STAGE(c, STAGE_OUTPUT);
+                    put_row(opts, cb, user, base_y - 1 - c->roi_y, roi_w, line);
                 }
+                nrows--;
+            }
 
-                if (scale == 8) {
-                    /*--- 1/8 scale: DC-only ---*/
-                    uint8_t y_dc[4], cb_dc, cr_dc;
+            /* Convert and deliver pixel rows */
+            for (int py = 0; py < nrows; py++) {
+                int img_y = base_y + py;
+                if (!in_roi(c, img_y)) continue;
+                line = next_out(c, opts, user);
+                STAGE(c, STAGE_COLOR);
+                convert_plane_row(c, py, py_base + py, line);
+                STAGE(c, STAGE_OUTPUT);
+                put_row(opts, cb, user, img_y - c->roi_y, roi_w, line);
+            }
 
-                    for (int vy = 0; vy < ny_v; vy++)
-                        for (int hx = 0; hx < ny_h; hx++)
-                            if (decode_block_dc_only(&ctx, 0, &y_dc[vy * ny_h + hx]) != 0)
-                                goto fail;
+            if (fancy_v) {
+                memcpy(c->ybuf - ys, c->ybuf + (size_t)nrows * ys, ys);
+                memcpy(c->cbbuf - cs, c->cbbuf + (c->bs - 1) * cs, cs);
+                memcpy(c->crbuf - cs, c->crbuf + (c->bs - 1) * cs, cs);
+            }
+        }
+    }
 
-                    if (ctx.ncomp == 3) {
-                        if (decode_block_dc_only(&ctx, 1, &cb_dc) != 0) goto fail;
-                        if (decode_block_dc_only(&ctx, 2, &cr_dc) != 0) goto fail;
-                    } else {
-                        cb_dc = 128; cr_dc = 128;
-                    }
+    /* Last row: replicate the bottom chroma edge */
+    int last_y = c->mcus_y * c->out_mcu_h - 1;
+    if (fancy_v && last == c->mcus_y && in_roi(c, last_y)) {
+        line = next_out(c, opts, user);
+        STAGE(c, STAGE_COLOR);
+        convert_row(c, c->ybuf - ys, c->cbbuf - cs, c->cbbuf - cs,
+                    c->crbuf - cs, c->crbuf - cs, line);
+        STAGE(c, STAGE_OUTPUT);
+        put_row(opts, cb, user, last_y - c->roi_y, roi_w, line);
+    }
+    return 0;
+}
 
-                    /* Each MCU → (ny_h × ny_v) output pixels at 1/8 */
-                    int ox0 = mcu_x * ny_h;
-                    for (int vy = 0; vy < ny_v; vy++) {
-                        for (int hx = 0; hx < ny_h; hx++) {
-                            int ox = ox0 + hx;
-                            int oy = vy;  /* row within this MCU's output */
-                            if (ox >= out_w || oy >= buf_rows) continue;
-
-                            uint8_t Y = y_dc[vy * ny_h + hx];
-                            uint8_t Cb_v = cb_dc, Cr_v = cr_dc;
-                            row_buf[oy * out_w + ox] = ycbcr_to_rgb565(Y, Cb_v, Cr_v);
-                        }
-                    }
-                } else if (scale == 4) {
-                    /*--- 1/4 scale: full IDCT then average 4x4 quadrants ---*/
-                    for (int vy = 0; vy < ny_v; vy++)
-                        for (int hx = 0; hx < ny_h; hx++) {
-                            if (decode_block(&ctx, 0, y_blocks[vy * ny_h + hx]) != 0)
-                                goto fail;
-                            block_to_2x2(y_blocks[vy * ny_h + hx], y_2x2[vy * ny_h + hx]);
-                        }
+#if FJPEG_PIPE
+/* FJPEG_PIPELINE: start the worker on the entropy data and run the row
+ * loop on what it hands over. Rows reach cb from the calling thread. */
+static int decode_piped(fjctx_t *c, const fjpeg_opts_t *opts, uint8_t *body,
+                        fjpeg_row_cb cb, void *user)
+{
+    const fjpeg_workers_t *w = opts->workers;
+    fjhdr_t h;
+    ctx_hdr(c, &h);
+    fjpipe_t *p = (fjpipe_t *)body;
+    int nblk = pipe_blocks(&h);
+    size_t n = (size_t)FJPEG_PIPE_MCUS * nblk;
 
-                    if (ctx.ncomp == 3) {
-                        if (decode_block(&ctx, 1, cb_block) != 0) goto fail;
-                        if (decode_block(&ctx, 2, cr_block) != 0) goto fail;
-                        block_to_2x2(cb_block, cb_2x2);
-                        block_to_2x2(cr_block, cr_2x2);
-                    } else {
-                        memset(cb_2x2, 128, 4);
-                        memset(cr_2x2, 128, 4);
-                    }
+    p->ctx = *c;
+    p->w = w;
+    p->blk = (int16_t *)(body + WORK_ALIGN(sizeof(fjpipe_t)));
+    p->last = (uint8_t *)(p->blk + n * 64);
+    p->nblk = nblk;
+    p->head = p->tail = 0;
+    p->sleeping[0] = p->sleeping[1] = 0;
+    memset(p->blk, 0, n * 64 * sizeof(int16_t));
+    roi_mcu_rows(c, fancy_v_mode(&h, opts), &p->first, &p->end);
 
-                    /* Each 8x8 block → 2x2 pixels. MCU → (ny_h*2 × ny_v*2) pixels */
-                    int ox0 = mcu_x * ny_h * 2;
-                    for (int vy = 0; vy < ny_v; vy++) {
-                        for (int hx = 0; hx < ny_h; hx++) {
-                            uint8_t *yp = y_2x2[vy * ny_h + hx];
-                            for (int sy = 0; sy < 2; sy++) {
-                                for (int sx = 0; sx < 2; sx++) {
-                                    int ox = ox0 + hx * 2 + sx;
-                                    int oy = vy * 2 + sy;
-                                    if (ox >= out_w || oy >= buf_rows) continue;
-
-                                    uint8_t Y = yp[sy * 2 + sx];
-                                    /* Chroma: nearest-neighbor from scaled chroma */
-                                    int cx = (hx * 2 + sx) >> h_shift;
-                                    int cy = (vy * 2 + sy) >> v_shift;
-                                    uint8_t Cb_v = cb_2x2[cy * 2 + cx];
-                                    uint8_t Cr_v = cr_2x2[cy * 2 + cx];
-
-                                    row_buf[oy * out_w + ox] = ycbcr_to_rgb565(Y, Cb_v, Cr_v);
-                                }
-                            }
-                        }
-                    }
-                } else {
-                    /*--- 1:1 scale ---*/
-                    for (int vy = 0; vy < ny_v; vy++)
-                        for (int hx = 0; hx < ny_h; hx++)
-                            if (decode_block(&ctx, 0, y_blocks[vy * ny_h + hx]) != 0)
-                                goto fail;
-
-                    if (ctx.ncomp == 3) {
-                        if (decode_block(&ctx, 1, cb_block) != 0) goto fail;
-                        if (decode_block(&ctx, 2, cr_block) != 0) goto fail;
-                    }
+    c->pipe = p;
+    w->run(pipe_run, p, w->user);
+    int ret = decode_rows(c, opts, body + pipe_size(&h), cb, user);
+    w->wait(w->user);
+    c->pipe = NULL;
+#if FJPEG_STATS
+    stats_merge(c, &p->ctx);
+#endif
+    c->damaged |= p->ctx.damaged;
+    return ret;
+}
+#endif
 
-                    /* Convert MCU to RGB565 in row_buf */
-                    int px0 = mcu_x * ctx.mcu_w;
-                    for (int py = py_base; py < py_base + buf_rows; py++) {
-                        int img_y = mcu_y * ctx.mcu_h + py;
-                        if (img_y >= ctx.height) break;
-
-                        for (int px = 0; px < ctx.mcu_w; px++) {
-                            int img_x = px0 + px;
-                            if (img_x >= out_w) break;
-
-                            uint8_t Y, Cb_v, Cr_v;
-
-                            if (ctx.ncomp == 1) {
-                                Y = y_blocks[0][py * 8 + px];
-                                Cb_v = 128; Cr_v = 128;
-                            } else {
-                                int yb = (py >> 3) * ny_h + (px >> 3);
-                                Y = y_blocks[yb][(py & 7) * 8 + (px & 7)];
-                                int cx = px >> h_shift;
-                                int cy = py >> v_shift;
-                                Cb_v = cb_block[cy * 8 + cx];
-                                Cr_v = cr_block[cy * 8 + cx];
-                            }
-
-                            row_buf[(py - py_base) * out_w + img_x] =
-                                ycbcr_to_rgb565(Y, Cb_v, Cr_v);
-                        }
-                    }
-                }
+/* Decode the entropy data, or for progressive images output the store,
+ * with body scratch laid out by work_body() */
+static int decode_output(fjctx_t *c, const fjpeg_opts_t *opts, uint8_t *body,
+                         fjpeg_row_cb cb, void *user)
+{
+    fjhdr_t h;
+    ctx_hdr(c, &h);
+
+    if (opts->tile_cb)
+        return decode_tiles(c, opts, body, user);
+
+    /* Restart intervals decode independently: hand whole bands of them
+     * to the caller's workers. Bands always hold full MCU rows. */
+    int rows = parallel_rows(&h, opts);
+    if (rows) {
+        c->buf_rows = c->out_mcu_h;
+        return decode_parallel(c, opts, rows, body, cb, user);
+    }
+#if FJPEG_PIPE
+    /* Otherwise entropy decoding can still run beside the rest */
+    if (pipe_mode(&h, opts))
+        return decode_piped(c, opts, body, cb, user);
+#endif
+    return decode_rows(c, opts, body, cb, user);
+}
+
+/* Progressive: decode scans into the store and output it once opts->scans
+ * have been decoded (0 = all) or the stream ends. With
+ * FJPEG_REFINE_PASSES decoding goes on, and the image is output again
+ * after every later scan that changed the store. */
+static int decode_passes(fjctx_t *c, const fjpeg_opts_t *opts, uint8_t *body,
+                         fjpeg_row_cb cb, void *user)
+{
+    int refine = (opts->flags & FJPEG_REFINE_PASSES) != 0;
+    int first = opts->scans ? opts->scans : refine;
+    int dirty = 0, shown = 0;
+
+    for (int n = 1;; n++) {
+        int ret = decode_scan(c);
+        if (ret < 0) {
+            /* Concealed: the scan's remaining blocks keep the earlier
+             * scans' coefficients */
+            if (!c->conceal) return -1;
+            c->damaged = 1;
+            ret = 1;
+        }
+        dirty |= ret;
+
+        int end = n == first && !refine;
+        if (!end) {
+            if ((ret = next_scan(c)) < 0) return -1;
+            end = ret > 0;
+        }
+        if (end ? dirty || !shown : refine && dirty && n >= first) {
+            if (decode_output(c, opts, body, cb, user) != 0) return -1;
+            dirty = 0;
+            shown = 1;
+        }
+        if (end) return 0;
+    }
+}
+
+static int decode_run(fjctx_t *c, const fjpeg_opts_t *opts, uint8_t *body,
+                      fjpeg_row_cb cb, void *user)
+{
+    if (c->progressive) {
+        body += set_coefs(c, body);
+        return decode_passes(c, opts, body, cb, user);
+    }
+    return decode_output(c, opts, body, cb, user);
+}
+
+/* decode_run(), for a target size through the resampler at the start of
+ * body, as work_body() lays it out */
+static int decode_fit(fjctx_t *c, const fjpeg_opts_t *opts, uint8_t *body,
+                      fjpeg_row_cb cb, void *user)
+{
+    if (!opts->target_w) return decode_run(c, opts, body, cb, user);
+    fjhdr_t h;
+    fjpeg_opts_t o;
+    ctx_hdr(c, &h);
+    fit_opts(&h, opts, &o);
+    fjresize_t *rs = (fjresize_t *)body;
+    body += resize_init(body, c, opts, cb, user);
+    return decode_run(c, &o, body, NULL, rs);
+}
+
+int fjpeg_decode_ex(const void *data, size_t len, const fjpeg_opts_t *opts,
+                    fjpeg_row_cb cb, void *user)
+{
+    if (!valid_opts(opts)) return -1;
+    /* Rotating buffers in the decoder's own scratch are gone on return,
+     * so transfers from them have to be waited for before that */
+    if (opts->out_bufs > 1 && !opts->work && !opts->out_wait) return -1;
+#if FJPEG_STATS
+    if (opts->stats) stats_clear(opts->stats);
+#endif
+
+    /* In-memory input is sized up front; pull input has to read the
+     * headers into the context before the body size is known */
+    size_t head = work_head(opts);
+    size_t need = opts->read ? head : fjpeg_work_size(data, len, opts);
+    if (need == 0) return -1;
+
+    /* Caller scratch, or one allocation for the whole decode */
+    uint8_t *mem = opts->work;
+    if (mem) {
+        if (opts->work_size < need || ((uintptr_t)mem & 7)) return -1;
+    } else {
+        mem = malloc(need);
+        if (!mem) return -1;
+    }
+
+    int ret = -1;
+    if (decode_setup(mem, data, len, opts) == 0) {
+        fjctx_t *c = (fjctx_t *)mem;
+        fjhdr_t h;
+        ctx_hdr(c, &h);
+        size_t body_size = work_body(&h, opts);
+        size_t have = (opts->work ? opts->work_size : need) - head;
+        uint8_t *body = mem + head;
+
+        /* Pull input without caller scratch: a second allocation now that
+         * the width is known */
+        if (opts->read && !opts->work)
+            body = malloc(body_size);
+        else if (body_size > have)
+            body = NULL;    /* parsed header differs from the probe */
+
+        if (body) {
+            ret = decode_fit(c, opts, body, cb, user);
+            if (ret == 0 && c->damaged) ret = 1;
+            if (!opts->work)
+                rot_drain(c, opts->target_w ? &((fjresize_t *)body)->out : &c->out,
+                          opts, user);
+            if (body != mem + head) free(body);
+        }
+    }
+#if FJPEG_STATS
+    if (opts->stats) stats_finish((fjctx_t *)mem, opts->stats);
+#endif
+
+    if (mem != opts->work) free(mem);
+    return ret;
+}
+
+/*--- Decode into a buffer ---*/
+
+typedef struct {
+    uint8_t *out;
+    size_t stride;
+    int bpp;
+} fjimage_t;
+
+static void image_row(int y, int w, const void *px, void *user)
+{
+    fjimage_t *t = user;
+    memcpy(t->out + (size_t)y * t->stride, px, (size_t)w * t->bpp);
+}
+
+/* Decode with o's options into out, rows stride bytes apart. Anything
+ * that would route the output elsewhere is overridden. */
+static int decode_image(const void *data, size_t len, fjpeg_opts_t *o,
+                        void *out, size_t stride)
+{
+    o->pixel_cb = image_row;
+    o->tile_cb = NULL;
+    o->out_bufs = 0;
+    o->out_wait = NULL;
+    if (o->format < 0 || o->format >= NUM_FORMATS) return -1;
+
+    fjimage_t t = { out, stride, formats[o->format].bpp };
+    return fjpeg_decode_ex(data, len, o, NULL, &t);
+}
+
+int fjpeg_thumbnail(const void *data, size_t len, const fjpeg_opts_t *opts,
+                    void *out, size_t stride)
+{
+    fjpeg_opts_t o;
+    if (opts) o = *opts;
+    else memset(&o, 0, sizeof(o));
+    o.scale = 8;
+    o.target_w = o.target_h = 0;
+    return decode_image(data, len, &o, out, stride);
+}
+
+/*--- Batch decode ---*/
+
+typedef struct {
+    fjpeg_job_t *jobs;
+    int n;
+    int next;               /* next job to take */
+    int count;              /* workers */
+    uint8_t *work;          /* count slices of slice bytes, or NULL */
+    size_t slice;
+} fjbatch_t;
+
+typedef struct {
+    fjbatch_t *b;
+    int id;
+} fjbworker_t;
+
+/* The k-th job worker w takes. With atomics it is whichever job is next,
+ * so workers that draw small images keep taking more and a few large
+ * ones never leave the rest idle; without, every count-th job. */
+static int take_job(fjbworker_t *w, int k)
+{
+#if defined(__GNUC__)
+    (void)k;
+    return __atomic_fetch_add(&w->b->next, 1, __ATOMIC_RELAXED);
+#else
+    return w->id + k * w->b->count;
+#endif
+}
+
+static void job_opts(const fjpeg_job_t *j, fjpeg_opts_t *o)
+{
+    *o = j->opts;
+    o->pixel_cb = image_row;           /* as decode_image() sets it */
+    o->workers = NULL;
+    o->read = NULL;
+    o->flags &= ~FJPEG_KEEP_TABLES;    /* scratch moves between images */
+}
+
+size_t fjpeg_job_work_size(const fjpeg_job_t *job)
+{
+    fjpeg_opts_t o;
+    job_opts(job, &o);
+    return fjpeg_work_size(job->data, job->len, &o);
+}
+
+static void batch_worker(void *arg)
+{
+    fjbworker_t *w = arg;
+    fjbatch_t *b = w->b;
+    uint8_t *mem = b->work ? b->work + (size_t)w->id * b->slice : NULL;
+    size_t cap = b->work ? b->slice : 0;
+
+    for (int k = 0, i; (i = take_job(w, k)) < b->n; k++) {
+        fjpeg_job_t *j = &b->jobs[i];
+        fjpeg_opts_t o;
+        job_opts(j, &o);
+        j->result = -1;
+
+        /* Without caller scratch, one block per worker, grown to the
+         * largest image so far */
+        if (!b->work) {
+            size_t need = fjpeg_job_work_size(j);
+            if (need == 0) continue;
+            if (need > cap) {
+                free(mem);
+                mem = malloc(need);
+                cap = mem ? need : 0;
+                if (!mem) continue;
             }
+        }
+        o.work = mem;
+        o.work_size = cap;
+        j->result = decode_image(j->data, j->len, &o, j->out, j->stride);
+    }
+    if (!b->work) free(mem);
+}
 
-            /* Deliver pixel rows */
-            int base_y = mcu_y * out_mcu_h + (two_pass ? pass * 8 : 0);
-            for (int py = 0; py < buf_rows; py++) {
-                int img_y = base_y + py;
-                if (img_y >= out_h) break;
-                cb(img_y, out_w, row_buf + py * out_w, user);
+int fjpeg_decode_batch(fjpeg_job_t *jobs, int n, const fjpeg_workers_t *workers,
+                       void *work, size_t work_size)
+{
+    int count = workers && workers->count > 1 ? workers->count : 1;
+    if (count > n) count = n;
+    if (n <= 0) return 0;
+
+    fjbatch_t b = { jobs, n, 0, count, work, 0 };
+    fjbworker_t *w = malloc(count * sizeof(fjbworker_t));
+    if (!w || ((uintptr_t)work & 7)) {
+        free(w);
+        for (int i = 0; i < n; i++) jobs[i].result = -1;
+        return n;
+    }
+    if (work) b.slice = work_size / count & ~(size_t)7;
+
+    for (int i = 0; i < count; i++) {
+        w[i].b = &b;
+        w[i].id = i;
+    }
+    if (count == 1) {
+        batch_worker(&w[0]);
+    } else {
+        for (int i = 0; i < count; i++)
+            workers->run(batch_worker, &w[i], workers->user);
+        workers->wait(workers->user);
+    }
+    free(w);
+
+    int failed = 0;
+    for (int i = 0; i < n; i++)
+        if (jobs[i].result < 0) failed++;
+    return failed;
+}
+
+/*--- Index build ---*/
+
+size_t fjpeg_index_size(const void *data, size_t len)
+{
+    fjhdr_t h;
+    if (read_header(data, len, &h) != 0 || !h.mcu_h) return 0;
+    return FJPEG_INDEX_HEADER + (size_t)((h.height + h.mcu_h - 1) / h.mcu_h) * FJPEG_INDEX_ENTRY;
+}
+
+int fjpeg_build_index(const void *data, size_t len, const fjpeg_opts_t *opts,
+                      void *index, size_t index_size)
+{
+    /* Only the context is needed: a 1:1 setup with no output */
+    fjpeg_opts_t o;
+    memset(&o, 0, sizeof(o));
+    o.scale = 1;
+    if (opts) {
+        if (opts->read) return -1;
+        o.work = opts->work;
+        o.work_size = opts->work_size;
+    }
+
+    size_t need = work_head(&o);
+    uint8_t *mem = o.work;
+    if (mem) {
+        if (o.work_size < need || ((uintptr_t)mem & 7)) return -1;
+    } else {
+        mem = malloc(need);
+        if (!mem) return -1;
+    }
+
+    int ret = -1;
+    if (decode_setup(mem, data, len, &o) == 0 && !((fjctx_t *)mem)->progressive) {
+        fjctx_t *c = (fjctx_t *)mem;
+        uint8_t *idx = index;
+        if (index_size >= FJPEG_INDEX_HEADER + (size_t)c->mcus_y * FJPEG_INDEX_ENTRY) {
+            idx[0] = 'F'; idx[1] = 'J'; idx[2] = 'I'; idx[3] = 1;
+            put16(idx + 4, c->width);
+            put16(idx + 6, c->height);
+            put16(idx + 8, c->mcus_y);
+            put16(idx + 10, c->restart_interval);
+            put32(idx + 12, (uint32_t)(c->base + c->pos));
+            idx += FJPEG_INDEX_HEADER;
+
+            ret = 0;
+            for (int y = 0; y < c->mcus_y && ret == 0; y++) {
+                index_entry(c, idx + (size_t)y * FJPEG_INDEX_ENTRY);
+                for (int x = 0; x < c->mcus_x && ret == 0; x++) {
+                    restart_check(c);
+                    ret = skip_mcu(c) != 0 || stream_bad(c) ? -1 : 0;
+                }
             }
         }
     }
 
-    free(row_buf);
+    if (mem != o.work) free(mem);
+    return ret;
+}
+
+/*--- Mapped input ---*/
+
+int fjpeg_map_file(const char *path, fjpeg_map_t *m)
+{
+    memset(m, 0, sizeof(*m));
+#if FJPEG_MMAP && !defined(ESP_PLATFORM)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (uintmax_t)st.st_size <= SIZE_MAX)
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    m->data = p;
+    m->len = (size_t)st.st_size;
+
+    /* Decoding reads front to back; from the SOS on it reads everything,
+     * so start paging the entropy data in now */
+    posix_madvise(p, m->len, POSIX_MADV_SEQUENTIAL);
+    fjhdr_t h;
+    read_header(m->data, m->len, &h);
+    long page = sysconf(_SC_PAGESIZE);
+    if (h.sos && page > 0) {
+        size_t off = h.sos - h.sos % (size_t)page;
+        posix_madvise((uint8_t *)p + off, m->len - off, POSIX_MADV_WILLNEED);
+    }
     return 0;
+#else
+    (void)path;
+    return -1;
+#endif
+}
 
-fail:
-    free(row_buf);
+int fjpeg_map_partition(const void *partition, size_t offset, size_t len, fjpeg_map_t *m)
+{
+    memset(m, 0, sizeof(*m));
+#if FJPEG_MMAP && defined(ESP_PLATFORM)
+    const esp_partition_t *part = partition;
+    if (!part || offset >= part->size) return -1;
+    if (len == 0 || len > part->size - offset) len = part->size - offset;
+    const void *p;
+    esp_partition_mmap_handle_t handle;
+    if (esp_partition_mmap(part, offset, len, ESP_PARTITION_MMAP_DATA, &p, &handle) != ESP_OK)
+        return -1;
+    m->data = p;
+    m->len = len;
+    m->handle = handle;
+    return 0;
+#else
+    (void)partition; (void)offset; (void)len;
     return -1;
+#endif
+}
+
+void fjpeg_unmap(fjpeg_map_t *m)
+{
+#if FJPEG_MMAP && defined(ESP_PLATFORM)
+    if (m->data) esp_partition_munmap((esp_partition_mmap_handle_t)m->handle);
+#elif FJPEG_MMAP
+    if (m->data) munmap((void *)m->data, m->len);
+#endif
+    memset(m, 0, sizeof(*m));
 }
@@ -1,13 +1,17 @@
 /*
  * femtojpeg.h — Ultra-minimal baseline JPEG decoder
  *
- * Decodes baseline (SOF0) JPEG to RGB565 via row callbacks.
+ * Decodes baseline (SOF0) and progressive (SOF2) JPEG to RGB565 (or
+ * RGB888, RGBA8888, Y8, planar YCbCr) via row callbacks.
  * Supports: grayscale, YCbCr 4:4:4, 4:2:2, 4:2:0 subsampling.
- * Does not support: progressive, arithmetic coding, multi-scan.
+ * Does not support: arithmetic coding, multi-scan sequential.
+ * Progressive images need a coefficient store for the whole image in
+ * the scratch block (2 bytes per block at 1/8, 128 otherwise).
  *
- * ~1.3 KB static context. No external dependencies. No dynamic allocation
- * except a row buffer sized to output width.
- * Supports 1/4 and 1/8 downscaling for large images.
+ * ~7.5 KB context (~1.3 KB with FJPEG_HUFF_LOOKAHEAD=0). No external
+ * dependencies. One scratch block (context + row buffer) per decode, either
+ * malloc'ed or supplied by the caller.
+ * Supports 1/2, 1/4 and 1/8 downscaling for large images.
  *
  * MIT License — see LICENSE file.
  */
@@ -22,15 +26,349 @@ typedef struct {
     uint16_t height;
 } fjpeg_info_t;
 
+/* Decode flags for fjpeg_opts_t.flags */
+#define FJPEG_SINGLE_PASS 0x01  /* H2V2 at 1:1: buffer a full 16-row MCU strip
+                                 * (out_w * 8 more bytes) and entropy-decode
+                                 * each MCU once instead of twice */
+#define FJPEG_FANCY_UPSAMPLING 0x02 /* Triangle-filter 4:2:2 / 4:2:0 chroma as
+                                 * libjpeg does instead of replicating it.
+                                 * H2V2 then decodes single-pass and
+                                 * serially. */
+#define FJPEG_KEEP_TABLES 0x04  /* Motion JPEG: keep the quantization and
+                                 * Huffman tables in the caller's scratch
+                                 * from frame to frame (see fjpeg_opts_t.work) */
+#define FJPEG_REFINE_PASSES 0x08 /* Progressive: after the preview of
+                                 * fjpeg_opts_t.scans, deliver the whole
+                                 * image again after every later scan */
+#define FJPEG_CONCEAL 0x10      /* Damaged entropy data: fill the rest of
+                                 * the restart interval (or image) with
+                                 * gray and go on at the next RSTn instead
+                                 * of failing; the decode returns 1 */
+#define FJPEG_ACCURATE_IDCT 0x20 /* libjpeg's islow IDCT in 32-bit sums
+                                 * instead of the 16-bit Winograd one:
+                                 * samples match libjpeg's, with no
+                                 * overflow at high quality */
+#define FJPEG_PIPELINE 0x40     /* With workers and no restart bands to
+                                 * split: entropy-decode on one worker
+                                 * while the calling thread runs the IDCT,
+                                 * color conversion and callbacks */
+#define FJPEG_RESIZE_BILINEAR 0x80 /* With target_w/h: resample bilinearly
+                                 * instead of averaging each output
+                                 * pixel's area (box filter) */
+
+/* Output formats for fjpeg_opts_t.format */
+enum {
+    FJPEG_FMT_RGB565,       /* uint16_t, native byte order (default) */
+    FJPEG_FMT_RGB565_BE,    /* RGB565 high byte first, as SPI LCDs take it */
+    FJPEG_FMT_RGB565_LE,    /* RGB565 low byte first */
+    FJPEG_FMT_RGB888,       /* 3 bytes: R, G, B */
+    FJPEG_FMT_RGBA8888,     /* 4 bytes: R, G, B, 255 */
+    FJPEG_FMT_Y8,           /* 1 byte luma */
+    FJPEG_FMT_YCBCR         /* planar row: w bytes Y, then w Cb, then w Cr */
+};
+
+/* Row callback for any output format: pixels holds w pixels of row y in
+ * the format chosen in fjpeg_opts_t. */
+typedef void (*fjpeg_pixel_cb)(int y, int w, const void *pixels, void *user);
+
+/* Tile callback: pixels holds a w x h tile with its top-left corner at
+ * (x, y), in the format chosen in fjpeg_opts_t, each row laid out as
+ * fjpeg_pixel_cb would get it and w pixels long. Tiles are one MCU
+ * (or tile_mcus MCUs side by side) clipped to the image and the crop. */
+typedef void (*fjpeg_tile_cb)(int x, int y, int w, int h, const void *pixels, void *user);
+
+/* Pull input: copy up to n bytes of the file into buf and return how many
+ * were copied. 0 means end of data (or a read error). */
+typedef size_t (*fjpeg_read_cb)(uint8_t *buf, size_t n, void *user);
+
+/* Job runner for restart-interval parallel decode. run() starts fn(arg)
+ * on a worker and may return before it finishes (or just call it inline);
+ * wait() returns once every job started since the last wait() is done.
+ * At most count jobs are started between waits.
+ *
+ * FJPEG_PIPELINE runs one job alongside the calling thread, so run()
+ * must really start it elsewhere. The two then wait on each other for
+ * ring slots: by spinning, which needs them on two separate cores (on
+ * one, each wait burns the rest of a time slice), or with sleep and
+ * wake set (both or neither), by sleep(id) until wake(id) from the
+ * other side, id 0 being the calling thread and 1 the job. A wake()
+ * that comes first makes the next sleep() return at once, as with a
+ * binary semaphore or a FreeRTOS task notification; sleep() may also
+ * return early. */
+typedef struct {
+    int count;
+    void (*run)(void (*fn)(void *arg), void *arg, void *user);
+    void (*wait)(void *user);
+    void *user;
+    void (*sleep)(int id, void *user);
+    void (*wake)(int id, void *user);
+} fjpeg_workers_t;
+
+/* Decode stages, indexing fjpeg_stats_t.ticks */
+enum {
+    FJPEG_STAGE_PARSE,      /* markers and tables */
+    FJPEG_STAGE_HUFF,       /* entropy decoding */
+    FJPEG_STAGE_IDCT,       /* block reconstruction */
+    FJPEG_STAGE_COLOR,      /* upsampling and color conversion */
+    FJPEG_STAGE_OUTPUT,     /* callbacks and out_wait */
+    FJPEG_STAGES
+};
+
+/* Decode statistics (fjpeg_opts_t.stats), counted only when femtojpeg.c
+ * is built with FJPEG_STATS=1. Set clock, if at all, before the decode;
+ * the decode overwrites everything else. With workers, blocks through
+ * ticks are summed over all threads, and clock must be thread-safe. */
+typedef struct {
+    uint64_t (*clock)(void *user);  /* optional timestamp, e.g. a cycle counter */
+    void *clock_user;
+    uint32_t blocks;        /* 8x8 blocks entropy-decoded (progressive: per scan) */
+    uint32_t dc_only;       /* blocks reconstructed from the DC alone */
+    uint32_t sparse;        /* blocks with only the 2x2 or 4x4 low-frequency
+                             * corner set (neither count applies at 1/8) */
+    uint32_t restarts;      /* RSTn markers resynchronized at */
+    uint32_t stuffed;       /* 0xFF 0x00 stuffing pairs read */
+    uint32_t huff_slow;     /* Huffman codes too long for the lookahead table
+                             * (every code with FJPEG_HUFF_LOOKAHEAD=0) */
+    size_t bytes;           /* input consumed, up to the furthest byte read */
+    uint64_t ticks[FJPEG_STAGES];   /* clock ticks spent in each stage */
+} fjpeg_stats_t;
+
+/* Rectangle in output pixels (after scaling) */
+typedef struct {
+    int x, y, w, h;
+} fjpeg_rect_t;
+
+typedef struct {
+    int scale;          /* 1, 2, 4 or 8; ignored with target_w/h */
+    unsigned flags;     /* FJPEG_* decode flags */
+    int format;         /* FJPEG_FMT_*, default RGB565 */
+    /* Optional. Receives the rows instead of the fjpeg_row_cb passed to
+     * fjpeg_decode_ex, which may then be NULL. Required for formats other
+     * than the three RGB565 ones. */
+    fjpeg_pixel_cb pixel_cb;
+    /* Optional. Receives the image tile by tile, left to right and top to
+     * bottom, instead of row by row (cb may then be NULL, and any format
+     * goes): no row buffer is kept, so scratch
+     * drops to one tile and the planes it is converted from. The decode
+     * is then serial, and FJPEG_FANCY_UPSAMPLING is ignored since its
+     * filters reach into the neighbouring MCUs. */
+    fjpeg_tile_cb tile_cb;
+    int tile_mcus;      /* MCUs per tile, 0 = 1 */
+    /* Optional output rotation. With out_bufs = n > 1, rows (or tiles)
+     * are converted into n buffers in turn, so each stays untouched for
+     * n - 1 more callbacks and a DMA transfer can run while the next is
+     * decoded. Before a buffer that was handed out is reused, out_wait,
+     * if set, is called with it and must return once the caller is done
+     * with it. Scratch grows by n - 1 rows or tiles; workers then only
+     * serve FJPEG_PIPELINE. The last n buffers are left to the caller
+     * when the scratch is the caller's (work). Otherwise it is freed on
+     * return, so out_wait is required and called for each of them
+     * before fjpeg_decode_ex returns. */
+    int out_bufs;
+    void (*out_wait)(const void *pixels, void *user);
+    /* Optional. With count > 1 and a DRI marker in the image, bands of
+     * restart intervals are decoded concurrently, each into its own
+     * buffer of full MCU rows. Rows still reach cb in order, from the
+     * calling thread. Otherwise FJPEG_PIPELINE puts entropy decoding on
+     * one of them, which also calls read for pull input; scratch grows
+     * by a context and FJPEG_PIPE_MCUS MCUs of coefficients. */
+    const fjpeg_workers_t *workers;
+    /* Optional scratch of work_size bytes, 8-byte aligned, at least
+     * fjpeg_work_size(). NULL: one malloc/free per decode. With
+     * FJPEG_KEEP_TABLES, frames decoded through the same scratch reuse
+     * the tables of earlier frames when they repeat them or leave them
+     * out; zero it before the first frame. */
+    void *work;
+    size_t work_size;
+    /* Optional pull input. When read is set, data/len passed to
+     * fjpeg_decode_ex are ignored and the file is read through a window of
+     * window bytes (0 = 4096) held in the scratch. Decoding is then always
+     * single-pass, and workers only serve FJPEG_PIPELINE, since the window
+     * never rewinds. */
+    fjpeg_read_cb read;
+    void *read_user;
+    size_t window;
+    /* Optional crop, inside the scaled image; w or h of 0 decodes the
+     * whole image. Rows reach the callback numbered from 0 at roi.y and
+     * roi.w pixels wide. MCUs left and right of the crop are only
+     * entropy-decoded, rows above it are skipped (seeking to a restart
+     * marker when the image has them) and decoding stops below it. */
+    fjpeg_rect_t roi;
+    /* Optional output size, instead of scale and roi. The image is
+     * decoded at the smallest scale that still covers target_w x
+     * target_h (1:1 when it is smaller) and resampled a row at a time to
+     * exactly that size on the way to the callback, which then gets rows
+     * 0..target_h - 1 of target_w pixels. No frame buffer is kept:
+     * scratch grows by a few rows of the target width. Not with tile_cb. */
+    int target_w, target_h;
+    /* Optional MCU-row index from fjpeg_build_index for this file. Rows
+     * above the crop are then skipped by seeking straight to the first
+     * needed row (reading and dropping bytes for pull input). An index
+     * that does not match the file makes the decode fail. */
+    const void *index;
+    size_t index_size;
+    /* Progressive only: output the image as soon as this many scans are
+     * decoded (0 = all of them) and stop reading there. With
+     * FJPEG_REFINE_PASSES decoding goes on (0 then means 1) and every
+     * later scan that adds detail delivers the whole image again, rows
+     * numbered from 0 each time. Baseline images have a single scan. */
+    int scans;
+    /* Optional. Receives the decode's counters (see fjpeg_stats_t);
+     * ignored unless built with FJPEG_STATS=1. */
+    fjpeg_stats_t *stats;
+} fjpeg_opts_t;
+
 /* Row callback: y = row (0=top), w = width, rgb565 = pixel data. */
 typedef void (*fjpeg_row_cb)(int y, int w, const uint16_t *rgb565, void *user);
 
 /* Get image dimensions without decoding. Returns 0 on success. */
 int fjpeg_info(const void *data, size_t len, fjpeg_info_t *info);
 
+/* Stream layout, from the headers alone */
+typedef struct {
+    uint16_t width, height;
+    uint8_t ncomp;              /* 1 (grayscale) or 3 (YCbCr) */
+    uint8_t hsamp[3], vsamp[3]; /* sampling factors from the SOF: Y at 2x2
+                                 * is 4:2:0, 2x1 4:2:2, 1x1 4:4:4 */
+    uint8_t progressive;        /* SOF2 */
+    uint16_t mcu_w, mcu_h;      /* MCU size in pixels */
+    uint16_t restart_interval;  /* MCUs per restart interval, 0 = no DRI */
+    size_t sos;                 /* file offset of the first SOS marker, 0 if
+                                 * the data ends before it */
+    size_t exif_thumb;          /* file offset and length of the JPEG */
+    size_t exif_thumb_len;      /* thumbnail in the EXIF APP1, 0 if none */
+    size_t work_size[4];        /* fjpeg_work_size() at scale 1, 2, 4 and 8
+                                 * with otherwise zeroed opts; 0 where the
+                                 * image is too small for the scale */
+} fjpeg_probe_t;
+
+/* Describe the stream without allocating or decoding anything, reading
+ * the markers up to the first SOS (a prefix of the file that far is
+ * enough). Returns 0 on success, -1 for a file the decoder rejects at
+ * the frame header. */
+int fjpeg_probe(const void *data, size_t len, fjpeg_probe_t *p);
+
+/* The JPEG thumbnail most cameras embed in their EXIF APP1 segment
+ * (usually 160x120 baseline), as a pointer into data: pass it to any of
+ * the decode calls for a preview in a fraction of the time even a 1/8
+ * decode of the full image takes. Only the markers up to the first EXIF
+ * APP1 and the TIFF entries leading to the thumbnail are read, so it
+ * works for frames the decoder rejects and for a file prefix that holds
+ * the APP1. Returns 0 if that APP1 has a thumbnail, -1 if not or if
+ * there is no EXIF APP1 before SOS (thumb is then NULL). */
+int fjpeg_exif_thumbnail(const void *data, size_t len, const void **thumb, size_t *thumb_len);
+
+/* Scratch bytes fjpeg_decode_ex needs for this image and these opts
+ * (work and work_size are ignored). Returns 0 if the header is bad.
+ * Any prefix of the file through the SOS header is enough, which is how
+ * to size scratch for pull input. */
+size_t fjpeg_work_size(const void *data, size_t len, const fjpeg_opts_t *opts);
+
 /* Decode JPEG to RGB565. Calls cb for each row. Returns 0 on success.
- * scale: 1 = full, 4 = quarter, 8 = eighth resolution. */
+ * scale: 1 = full, 2 = half, 4 = quarter, 8 = eighth resolution. */
 int fjpeg_decode(const void *data, size_t len, int scale,
                  fjpeg_row_cb cb, void *user);
 
+/* fjpeg_decode with options. A zeroed opts with scale set behaves exactly
+ * like fjpeg_decode. Entropy data that runs into a marker or the end of
+ * the file, holds an invalid code or skips a restart marker fails the
+ * decode as soon as it is reached, with the rows before it delivered;
+ * with FJPEG_CONCEAL the decode completes and returns 1. */
+int fjpeg_decode_ex(const void *data, size_t len, const fjpeg_opts_t *opts,
+                    fjpeg_row_cb cb, void *user);
+
+/* 1/8-scale thumbnail straight into out: (width / 8) x (height / 8)
+ * pixels in opts->format, rows stride bytes apart. opts may be NULL for
+ * RGB565; its scale, target size and pixel_cb are ignored, a crop
+ * applies. Only DC coefficients are decoded, with the AC ones skipped
+ * unread. Returns 0 on success. */
+int fjpeg_thumbnail(const void *data, size_t len, const fjpeg_opts_t *opts,
+                    void *out, size_t stride);
+
+/* One image of a batch: decoded with opts (work, workers, read and the
+ * callbacks are ignored) into out, rows stride bytes apart, as with
+ * fjpeg_thumbnail. result is set to 0 on success, -1 on failure (1 for an
+ * image FJPEG_CONCEAL repaired, which does not count as failed). */
+typedef struct {
+    const void *data;
+    size_t len;
+    fjpeg_opts_t opts;
+    void *out;
+    size_t stride;
+    int result;
+} fjpeg_job_t;
+
+/* Decode n images, spread over the workers (NULL: all on the calling
+ * thread). Each worker decodes one image at a time in its own scratch:
+ * an equal share of work (8-byte aligned; each share must cover the
+ * largest fjpeg_job_work_size() in the batch) or, when work is NULL, one
+ * block it allocates and grows as needed. Workers take the next
+ * undecoded image whenever they finish one. Returns the number of jobs
+ * that failed. */
+int fjpeg_decode_batch(fjpeg_job_t *jobs, int n, const fjpeg_workers_t *workers,
+                       void *work, size_t work_size);
+
+/* Scratch bytes one job of a batch needs, with its opts as the batch
+ * decodes it. fjpeg_work_size() on the job's opts as they stand fails
+ * for formats other than RGB565, which need a pixel_cb. 0 if the header
+ * or opts are bad. */
+size_t fjpeg_job_work_size(const fjpeg_job_t *job);
+
+/* MCU-row index: the entropy-decoder state at the start of every MCU
+ * row, so later decodes can start at any row without decoding the ones
+ * before it. The layout is fixed, little-endian and packed, to be kept
+ * next to cached files:
+ *
+ *   header, 16 bytes:
+ *     0  4  "FJI" and version 1
+ *     4  2  width
+ *     6  2  height
+ *     8  2  MCU rows (entries)
+ *    10  2  restart interval
+ *    12  4  file offset of the first entropy-coded byte
+ *   one 16-byte entry per MCU row:
+ *     0  4  file offset of the byte holding the row's first bit
+ *     4  1  bits of that byte already used (0-7)
+ *     5  1  next expected RSTn (0-7)
+ *     6  2  MCUs left in the current restart interval
+ *     8  6  DC predictors of the three components, int16
+ *    14  2  zero
+ */
+#define FJPEG_INDEX_HEADER 16
+#define FJPEG_INDEX_ENTRY  16
+
+/* Bytes of index for this image, or 0 if the header is bad */
+size_t fjpeg_index_size(const void *data, size_t len);
+
+/* Entropy-decode the whole image once (no IDCT or color conversion) and
+ * write its index. opts may be NULL; only work/work_size are used, and
+ * the data must be in memory. Returns 0 on success; progressive images
+ * have no index. */
+int fjpeg_build_index(const void *data, size_t len, const fjpeg_opts_t *opts,
+                      void *index, size_t index_size);
+
+/* Input mapped read-only into memory: pass data and len to any of the
+ * decode calls, with no copy of the file. */
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    uintptr_t handle;   /* platform mapping, for fjpeg_unmap */
+} fjpeg_map_t;
+
+/* Map a whole file (POSIX hosts). The kernel is told the file is read
+ * sequentially and asked to start reading the entropy data, from the
+ * first SOS marker on, right away. The decoder never reads past len, so
+ * a truncated file decodes as far as it goes; the file must not shrink
+ * while mapped. Returns 0 on success, -1 if the file cannot be mapped
+ * (including empty and non-regular files). */
+int fjpeg_map_file(const char *path, fjpeg_map_t *m);
+
+/* Map len bytes at offset of a flash partition (ESP-IDF, a
+ * const esp_partition_t *) for a flash-resident asset; len 0 or past the
+ * end means up to the end of the partition. Returns 0 on success. */
+int fjpeg_map_partition(const void *partition, size_t offset, size_t len, fjpeg_map_t *m);
+
+/* Release a mapping from either call; a zeroed m is a no-op */
+void fjpeg_unmap(fjpeg_map_t *m);
+
 #endif /* FEMTOJPEG_H */